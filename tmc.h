@@ -59,6 +59,159 @@ struct usbtmc_termchar
 	__u8 term_char_enabled; // bool
 } __attribute__ ((packed));
 
+/*
+ * Streaming mode, see USBTMC_IOCTL_STREAM_START.
+ *
+ * The mmap()ed area starts with one page holding struct
+ * usbtmc_stream_ctrl followed by ring_size bytes of records. Each record
+ * is a struct usbtmc_stream_rec followed by len data bytes and padded
+ * to a multiple of 8 bytes. The driver advances head after writing a
+ * record, the application advances tail after consuming one.
+ */
+struct usbtmc_stream_config
+{
+	__u32 ring_size;	/* multiple of the page size */
+	__u32 transfer_size;	/* bytes requested per message */
+} __attribute__ ((packed));
+
+struct usbtmc_stream_ctrl
+{
+	__u32 head;	/* written by the driver */
+	__u32 tail;	/* written by the application */
+	__u32 size;	/* ring_size */
+	__u32 flags;	/* USBTMC_STREAM_* */
+	__s32 error;	/* errno that stopped the stream */
+} __attribute__ ((packed));
+
+#define USBTMC_STREAM_STOPPED		1
+
+struct usbtmc_stream_rec
+{
+	__u32 len;	/* number of data bytes */
+	__u32 flags;	/* USBTMC_STREAM_REC_* */
+} __attribute__ ((packed));
+
+#define USBTMC_STREAM_REC_EOM		1	/* message ended with EOM */
+#define USBTMC_STREAM_REC_WRAP		2	/* next record is at offset 0 */
+
+/*
+ * Command and response of USBTMC_IOCTL_QUERY. The buffers are user
+ * pointers stored as __u64 so that the layout is the same for 32 and
+ * 64 bit programs.
+ */
+struct usbtmc_query
+{
+	__u64 cmd;		/* command to send */
+	__u64 resp;		/* buffer for the response */
+	__u32 cmd_len;		/* length of the command */
+	__u32 resp_size;	/* size of the response buffer */
+	__u32 resp_len;		/* returned: length of the response */
+} __attribute__ ((packed));
+
+/*
+ * Entries of USBTMC_IOCTL_BATCH. Each entry sends a message and, if
+ * in_size is not 0, reads the response into the in buffer.
+ */
+struct usbtmc_batch_entry
+{
+	__u64 out;		/* message to send */
+	__u64 in;		/* buffer for the response */
+	__u32 out_len;		/* length of the message */
+	__u32 in_size;		/* size of the response buffer, 0 = none */
+	__u32 in_len;		/* returned: length of the response */
+	__s32 status;		/* returned: 0 or -errno */
+} __attribute__ ((packed));
+
+struct usbtmc_batch
+{
+	__u64 entries;		/* array of struct usbtmc_batch_entry */
+	__u32 count;		/* number of entries, at most 1024 */
+} __attribute__ ((packed));
+
+#define USBTMC_BATCH_MAX_ENTRIES	1024
+
+/*
+ * SRQ notification queued for each open file. The timestamp is taken
+ * from CLOCK_MONOTONIC when the interrupt is received.
+ */
+struct usbtmc_srq_event
+{
+	__u64 timestamp;	/* nanoseconds */
+	__u8 stb;		/* status byte sent with the SRQ */
+	__u8 reserved[7];
+} __attribute__ ((packed));
+
+/* Argument of USBTMC488_IOCTL_READ_SRQ */
+struct usbtmc_srq_events
+{
+	__u64 events;		/* array of struct usbtmc_srq_event */
+	__u32 count;		/* size of the array */
+	__u32 n_events;		/* returned: number of events stored */
+	__u32 overflow;		/* returned: events dropped since last call */
+} __attribute__ ((packed));
+
+/* Argument of USBTMC488_IOCTL_WAIT_SRQ */
+struct usbtmc_wait_srq
+{
+	__u64 timestamp;	/* returned: time of the SRQ in nanoseconds */
+	__u32 timeout;		/* milliseconds */
+	__u8 mask;		/* status byte bits to wait for, 0 = any */
+	__u8 stb;		/* returned: status byte of the SRQ */
+	__u8 reserved[2];
+} __attribute__ ((packed));
+
+/*
+ * Returned by USBTMC_IOCTL_GET_TIMESTAMPS. The times are CLOCK_MONOTONIC
+ * nanoseconds taken by the driver, 0 if the event did not happen yet.
+ */
+struct usbtmc_timestamps
+{
+	__u64 srq;		/* last SRQ notification received */
+	__u64 write_start;	/* last write started */
+	__u64 write_end;	/* last bulk out data transfer completed */
+	__u64 read_start;	/* last REQUEST_DEV_DEP_MSG_IN sent */
+	__u64 read_end;		/* last bulk in transfer completed */
+	__u8 srq_stb;		/* status byte of the last SRQ */
+	__u8 reserved[7];
+} __attribute__ ((packed));
+
+/*
+ * Trigger groups. USBTMC488_IOCTL_SET_TRIGGER_GROUP sets the devices
+ * that USBTMC488_IOCTL_GROUP_TRIGGER sends a TRIGGER message to.
+ */
+struct usbtmc_trigger_group
+{
+	__u64 fds;		/* array of __s32 usbtmc file descriptors */
+	__u32 count;		/* number of file descriptors, 0 = none */
+} __attribute__ ((packed));
+
+#define USBTMC_TRIGGER_GROUP_MAX	32
+
+struct usbtmc_trigger_time
+{
+	__u64 submit;		/* TRIGGER message submitted, nanoseconds */
+	__u64 complete;		/* TRIGGER message sent, nanoseconds */
+	__s32 status;		/* 0 or -errno */
+	__u32 reserved;
+} __attribute__ ((packed));
+
+struct usbtmc_group_trigger
+{
+	__u64 times;		/* array of struct usbtmc_trigger_time */
+	__u32 count;		/* size of the array, at least the group size */
+} __attribute__ ((packed));
+
+/*
+ * Asynchronous control request, see USBTMC_IOCTL_CTRL_SUBMIT and
+ * USBTMC_IOCTL_CTRL_RESULT.
+ */
+struct usbtmc_async_ctrl
+{
+	struct usbtmc_request req;
+	__u64 data;		/* buffer of req.wLength bytes */
+	__s32 status;		/* returned: bytes transferred or -errno */
+} __attribute__ ((packed));
+
 /* Request values for USBTMC driver's ioctl entry point */
 #define USBTMC_IOC_NR			91
 #define USBTMC_IOCTL_INDICATOR_PULSE	_IO(USBTMC_IOC_NR, 1)
@@ -72,6 +225,10 @@ struct usbtmc_termchar
 #define USBTMC_IOCTL_SET_TIMEOUT 	_IOW(USBTMC_IOC_NR, 10, unsigned int)
 #define USBTMC_IOCTL_EOM_ENABLE	        _IOW(USBTMC_IOC_NR, 11, unsigned char)
 #define USBTMC_IOCTL_CONFIG_TERMCHAR	_IOW(USBTMC_IOC_NR, 12, struct usbtmc_termchar)
+#define USBTMC_IOCTL_ZC_READ_THRESHOLD	_IOW(USBTMC_IOC_NR, 13, __u32)
+#define USBTMC_IOCTL_ZC_WRITE_THRESHOLD	_IOW(USBTMC_IOC_NR, 14, __u32)
+#define USBTMC_IOCTL_STREAM_START	_IOW(USBTMC_IOC_NR, 15, struct usbtmc_stream_config)
+#define USBTMC_IOCTL_STREAM_STOP	_IO(USBTMC_IOC_NR, 16)
 
 #define USBTMC488_IOCTL_GET_CAPS	_IOR(USBTMC_IOC_NR, 17, unsigned char)
 #define USBTMC488_IOCTL_READ_STB	_IOR(USBTMC_IOC_NR, 18, unsigned char)
@@ -80,6 +237,20 @@ struct usbtmc_termchar
 #define USBTMC488_IOCTL_LOCAL_LOCKOUT	_IO(USBTMC_IOC_NR, 21)
 #define USBTMC488_IOCTL_TRIGGER 	_IO(USBTMC_IOC_NR, 22)
 
+#define USBTMC_IOCTL_QUERY		_IOWR(USBTMC_IOC_NR, 23, struct usbtmc_query)
+#define USBTMC_IOCTL_BATCH		_IOW(USBTMC_IOC_NR, 24, struct usbtmc_batch)
+#define USBTMC_IOCTL_PREFETCH		_IOW(USBTMC_IOC_NR, 25, __u32)
+#define USBTMC_IOCTL_READ_BUFFER	_IOW(USBTMC_IOC_NR, 26, __u32)
+#define USBTMC_IOCTL_READ_BLOCK		_IOR(USBTMC_IOC_NR, 27, __u64)
+#define USBTMC488_IOCTL_READ_SRQ	_IOWR(USBTMC_IOC_NR, 28, struct usbtmc_srq_events)
+#define USBTMC488_IOCTL_SRQ_EVENTFD	_IOW(USBTMC_IOC_NR, 29, __s32)
+#define USBTMC488_IOCTL_WAIT_SRQ	_IOWR(USBTMC_IOC_NR, 30, struct usbtmc_wait_srq)
+#define USBTMC_IOCTL_GET_TIMESTAMPS	_IOR(USBTMC_IOC_NR, 31, struct usbtmc_timestamps)
+#define USBTMC488_IOCTL_SET_TRIGGER_GROUP	_IOW(USBTMC_IOC_NR, 32, struct usbtmc_trigger_group)
+#define USBTMC488_IOCTL_GROUP_TRIGGER	_IOW(USBTMC_IOC_NR, 33, struct usbtmc_group_trigger)
+#define USBTMC_IOCTL_CTRL_SUBMIT	_IOW(USBTMC_IOC_NR, 34, struct usbtmc_async_ctrl)
+#define USBTMC_IOCTL_CTRL_RESULT	_IOWR(USBTMC_IOC_NR, 35, struct usbtmc_async_ctrl)
+
 /* Driver encoded usb488 capabilities */
 #define USBTMC488_CAPABILITY_TRIGGER         1
 #define USBTMC488_CAPABILITY_SIMPLE          2
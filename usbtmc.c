@@ -25,12 +25,27 @@
 //#define DEBUG
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/ctype.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/kref.h>
 #include <linux/slab.h>
 #include <linux/poll.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/rculist.h>
+#include <linux/completion.h>
+#include <linux/mm.h>
+#include <linux/mmu_context.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+#include <linux/timer.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/kfifo.h>
+#include <linux/eventfd.h>
+#include <linux/scatterlist.h>
 #include <linux/usb.h>
 #include "tmc.h"
 
@@ -59,11 +74,65 @@ module_param(usb_timeout, uint,  S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(usb_timeout, "USB timeout in milliseconds");
 
 /*
- * Maximum number of read cycles to empty bulk in endpoint during CLEAR and
- * ABORT_BULK_IN requests. Ends the loop if (for whatever reason) a short
- * packet is never read.
+ * Number of bulk in URBs that are kept queued on the bulk in endpoint
+ * while a message is being read.
  */
-#define USBTMC_MAX_READS_TO_CLEAR_BULK_IN	100
+#define USBTMC_IN_URBS		4
+/* Upper limit for the number of URBs queued on a bulk endpoint */
+#define USBTMC_MAX_URBS		16
+
+static unsigned int in_urbs = USBTMC_IN_URBS;
+module_param(in_urbs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(in_urbs, "Number of bulk in URBs queued during a read");
+
+/*
+ * Number of bulk out URBs, each carrying one DEV_DEP_MSG_OUT message,
+ * that are kept in flight during a write.
+ */
+#define USBTMC_OUT_URBS		4
+
+static unsigned int out_urbs = USBTMC_OUT_URBS;
+module_param(out_urbs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(out_urbs, "Number of bulk out URBs in flight during a write");
+
+/*
+ * Number of interrupt in URBs kept queued, so that a notification can
+ * be received while the previous one is being handled.
+ */
+#define USBTMC_IIN_URBS		4
+
+static unsigned int iin_urbs = USBTMC_IIN_URBS;
+module_param(iin_urbs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(iin_urbs, "Number of interrupt in URBs queued");
+
+/*
+ * CLEAR and ABORT requests finish within the usb timeout. Status checks
+ * that return PENDING are retried after 1, 2, 4, ... up to 64 ms, and
+ * each read that empties the bulk in endpoint waits at most 100 ms.
+ */
+#define USBTMC_STATUS_POLL_MIN_MS	1
+#define USBTMC_STATUS_POLL_MAX_MS	64
+#define USBTMC_DRAIN_TIMEOUT		100
+
+/* States of the response to a non-blocking read */
+#define USBTMC_IN_IDLE		0	/* no read started */
+#define USBTMC_IN_QUEUED	1	/* request sent, waiting for response */
+#define USBTMC_IN_BUFFERED	2	/* response data in in_pool[0] */
+
+/* SRQ events queued per file, must be a power of 2 */
+#define USBTMC_SRQ_QUEUE_SIZE	64
+
+/* Largest buffer accepted by USBTMC_IOCTL_READ_BUFFER */
+#define USBTMC_MAX_READ_BUFFER	(16 * 1024 * 1024)
+
+/* Largest ring accepted by USBTMC_IOCTL_STREAM_START */
+#define USBTMC_STREAM_MAX_RING	(64 * 1024 * 1024)
+/*
+ * Interval (in milliseconds) at which a full stream ring is rechecked,
+ * doubled after every check that still finds it full
+ */
+#define USBTMC_STREAM_POLL_MIN_MS	1
+#define USBTMC_STREAM_POLL_MAX_MS	64
 
 static const struct usb_device_id usbtmc_devices[] = {
 	{ USB_INTERFACE_INFO(USB_CLASS_APP_SPEC, 3, 0), },
@@ -96,6 +165,60 @@ struct usbtmc_device_data {
 
 	unsigned int bulk_in;
 	unsigned int bulk_out;
+	u16 bulk_in_maxp;	/* wMaxPacketSize of bulk in endpoint */
+
+	/* bulk URBs submitted by usbtmc_read and usbtmc_write */
+	struct usb_anchor in_anchor;
+	struct usb_anchor out_anchor;
+
+	/* URBs and DMA buffers for bulk transfers, allocated at probe */
+	size_t bufsize;		/* multiple of bulk_in_maxp */
+	struct usbtmc_urb *in_pool;
+	unsigned int in_pool_size;
+	struct usbtmc_urb *out_pool;
+	unsigned int out_pool_size;
+	/* header and alignment bytes of zero copy writes */
+	u8 *zc_out_buf;
+	/* TRIGGER message, only used with out_mutex held */
+	struct usbtmc_urb *trig_urb;
+
+	/*
+	 * streaming mode, written with io_mutex and in_mutex held and
+	 * freed after an RCU grace period so that usbtmc_poll can look at
+	 * it without locks
+	 */
+	struct usbtmc_stream __rcu *stream;
+
+	/* URBs of asynchronous reads and writes, see usbtmc_read_iter */
+	struct usb_anchor aio_anchor;
+	/* asynchronous control requests */
+	struct usb_anchor ctrl_anchor;
+	bool aio_read;		/* an asynchronous read owns in_pool[0] */
+
+	/*
+	 * bTag and bTag_last_write are protected by out_mutex,
+	 * bTag_last_read by in_mutex.
+	 */
+
+	/*
+	 * out_pool is used as a ring of URBs that stay in flight between
+	 * non-blocking writes. Protected by out_mutex, usbtmc_poll reads
+	 * the indices without it.
+	 */
+	unsigned int out_head;		/* next slot to submit */
+	unsigned int out_in_flight;	/* slots submitted and not yet reaped */
+
+	/*
+	 * Response of a non-blocking read, received into in_pool[0].
+	 * Protected by in_mutex, usbtmc_poll reads in_state and in_owner
+	 * without it.
+	 */
+	int in_state;			/* USBTMC_IN_* */
+	struct usbtmc_file_data *in_owner;	/* file that sent the request */
+	u8 in_tag;			/* bTag of the request */
+	size_t in_count;		/* bytes requested */
+	u8 *in_data;			/* data not yet read */
+	size_t in_len;
 
 	u8 bTag;
 	u8 bTag_last_write;	/* needed for abort */
@@ -106,14 +229,17 @@ struct usbtmc_device_data {
 	u8             bNotify2;
 	u16            ifnum;
 	u8             iin_bTag;
-	u8            *iin_buffer;
 	atomic_t       iin_data_valid;
 	unsigned int   iin_ep;
 	int            iin_ep_present;
 	int            iin_interval;
-	struct urb    *iin_urb;
+	struct urb    *iin_urb[USBTMC_MAX_URBS];
+	unsigned int   iin_pool_size;
 	u16            iin_wMaxPacketSize;
 
+	/* CLOCK_MONOTONIC times of the last SRQ and transfers */
+	struct usbtmc_timestamps ts;
+
 	/* coalesced usb488_caps from usbtmc_dev_capabilities */
 	__u8 usb488_caps;
 
@@ -130,10 +256,22 @@ struct usbtmc_device_data {
 
 	struct usbtmc_dev_capabilities	capabilities;
 	struct kref kref;
-	struct mutex io_mutex;	/* only one i/o function running at a time */
+	/*
+	 * io_mutex serializes open/release and the control ioctls, in_mutex
+	 * the bulk in endpoint and out_mutex the bulk out endpoint. They are
+	 * taken in this order; a read holds in_mutex and briefly out_mutex
+	 * to send its REQUEST_DEV_DEP_MSG_IN.
+	 */
+	struct mutex io_mutex;
+	struct mutex in_mutex;
+	struct mutex out_mutex;
 	wait_queue_head_t waitq;
 	struct fasync_struct *fasync;
-	spinlock_t dev_lock; /* lock for file_list */
+	/*
+	 * Serializes changes of file_list. usbtmc_interrupt() walks the
+	 * list under RCU without taking it.
+	 */
+	spinlock_t dev_lock;
 };
 #define to_usbtmc_data(d) container_of(d, struct usbtmc_device_data, kref)
 
@@ -143,28 +281,232 @@ struct usbtmc_device_data {
 struct usbtmc_file_data {
 	struct usbtmc_device_data *data;
 	struct list_head file_elem;
+	struct rcu_head rcu;	/* usbtmc_interrupt() may still walk file_elem */
 
-	u8             srq_byte;
-	atomic_t       srq_asserted;
+	/*
+	 * SRQ notifications not yet read, filled by usbtmc_interrupt().
+	 * Protected by srq_lock. When the queue is full the oldest event
+	 * is dropped and counted in srq_overflow.
+	 */
+	spinlock_t     srq_lock;
+	DECLARE_KFIFO(srq_queue, struct usbtmc_srq_event,
+		      USBTMC_SRQ_QUEUE_SIZE);
+	u32            srq_overflow;
+	/* signalled for each SRQ, protected by srq_lock */
+	struct eventfd_ctx *srq_eventfd;
+	/* woken for each SRQ queued on this file */
+	wait_queue_head_t srq_waitq;
 
 	/* These values are initialized with default values from device_data */
 	u8             TermChar;
 	bool           TermCharEnabled;
 	bool           auto_abort;
+
+	/* reads of at least this size go straight to user pages, 0 = off */
+	u32            zc_read_threshold;
+	/* writes of at least this size are sent from user pages, 0 = off */
+	u32            zc_write_threshold;
+	/*
+	 * Asynchronous control request, protected by ctrl_mutex. ctrl_done
+	 * is set by the completion handler and read by poll without locks.
+	 */
+	struct mutex   ctrl_mutex;
+	struct usbtmc_ctrl *ctrl;
+	bool           ctrl_done;
+
+	/* devices of the trigger group, protected by usbtmc_trigger_mutex */
+	struct usbtmc_device_data **trig_group;
+	u32            trig_count;
+
+	/* bytes requested after a query is written, 0 = no prefetch */
+	u32            prefetch_size;
+
+	/*
+	 * Buffered read mode: data received but not yet read. Protected
+	 * by in_mutex.
+	 */
+	u8            *rbuf;
+	u32            rbuf_size;	/* bytes requested per transfer, 0 = off */
+	u32            rbuf_off;
+	u32            rbuf_len;
+};
+
+/*
+ * State of the streaming mode. The memory holds the control page that
+ * is shared with the application followed by the ring of records. The
+ * structure stays around while the ring is mapped.
+ */
+struct usbtmc_stream {
+	struct kref kref;
+	struct usbtmc_file_data *file_data;	/* owner */
+	struct task_struct *thread;
+	void *mem;
+	struct usbtmc_stream_ctrl *ctrl;
+	u8 *ring;
+	u32 size;
+	u32 transfer_size;
+	u32 head;	/* driver copy of ctrl->head */
+	/* woken by usbtmc_poll, the thread waits on it while the ring is full */
+	wait_queue_head_t space_waitq;
+};
+
+/*
+ * A bulk URB together with its transfer buffer. Completion of the URB
+ * is signalled through done.
+ */
+struct usbtmc_urb {
+	struct urb *urb;
+	u8 *buffer;
+	struct completion done;
+	struct usbtmc_device_data *data;	/* waitq is woken on completion */
+	u8 bTag;	/* bTag of a bulk out message */
+	u64 done_ns;	/* completion time */
+};
+
+/*
+ * An asynchronous read or write submitted through read_iter/write_iter.
+ * The completion handlers hand over to a work item, which stops the
+ * timeout timer and completes the iocb. A read also needs the
+ * submitter's mm to copy the data to user space; its work item runs
+ * once both the REQUEST_DEV_DEP_MSG_IN and the bulk in URB have
+ * completed.
+ */
+struct usbtmc_aio {
+	struct kiocb *iocb;
+	struct usbtmc_device_data *data;
+	struct urb *urb;	/* only used by writes */
+	u8 *buffer;
+	size_t count;		/* bytes requested or sent */
+	u8 bTag;
+	struct work_struct work;
+	struct timer_list timer;	/* unlinks the URB after the usb timeout */
+	bool timed_out;
+
+	/* only used by reads */
+	struct usbtmc_urb *turb;	/* in_pool[0] while aio_read is set */
+	struct urb *req_urb;
+	u8 *req_buffer;
+	int req_status;
+	atomic_t pending;	/* URBs not yet completed */
+	struct mm_struct *mm;	/* NULL for kernel iterators */
+	struct iov_iter to;
+	const void *iter_mem;	/* copy of the iterator's segments */
+};
+
+/*
+ * A control request submitted with USBTMC_IOCTL_CTRL_SUBMIT. At most
+ * one is outstanding per file.
+ */
+struct usbtmc_ctrl {
+	struct usbtmc_file_data *file_data;
+	struct urb *urb;
+	struct usb_ctrlrequest *setup;
+	u8 *buffer;
+	void __user *ubuf;	/* receives the data of an IN request */
+	struct completion done;
 };
 
 /* Forward declarations */
 static struct usb_driver usbtmc_driver;
+static const struct file_operations fops;
+static int usbtmc_stream_stop(struct usbtmc_file_data *file_data);
+static void usbtmc_in_cancel(struct usbtmc_device_data *data);
+
+/*
+ * Serializes group triggers, which hold the out_mutex of several
+ * devices, and changes of trigger groups.
+ */
+static DEFINE_MUTEX(usbtmc_trigger_mutex);
+
+static void usbtmc_free_pool(struct usbtmc_device_data *data,
+			     struct usbtmc_urb *pool, unsigned int n,
+			     size_t size)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+	for (i = 0; i < n; i++) {
+		if (pool[i].buffer)
+			usb_free_coherent(data->usb_dev, size,
+					  pool[i].buffer,
+					  pool[i].urb->transfer_dma);
+		usb_free_urb(pool[i].urb);
+	}
+	kfree(pool);
+}
+
+/*
+ * Allocates n URBs with DMA capable buffers of size bytes.
+ * The pools are set up at probe time so that reads and writes do not
+ * need to allocate memory.
+ */
+static struct usbtmc_urb *usbtmc_alloc_pool(struct usbtmc_device_data *data,
+					    unsigned int n, size_t size)
+{
+	struct usbtmc_urb *pool;
+	struct urb *urb;
+	unsigned int i;
+
+	pool = kcalloc(n, sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			goto err;
+		pool[i].urb = urb;
+		pool[i].buffer = usb_alloc_coherent(data->usb_dev, size,
+						    GFP_KERNEL,
+						    &urb->transfer_dma);
+		if (!pool[i].buffer)
+			goto err;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		init_completion(&pool[i].done);
+		pool[i].data = data;
+	}
+	return pool;
+
+err:
+	usbtmc_free_pool(data, pool, n, size);
+	return NULL;
+}
 
 static void usbtmc_delete(struct kref *kref)
 {
 	struct usbtmc_device_data *data = to_usbtmc_data(kref);
 
 	pr_debug("%s - called\n", __func__);
+	usbtmc_free_pool(data, data->in_pool, data->in_pool_size,
+			 data->bufsize);
+	usbtmc_free_pool(data, data->out_pool, data->out_pool_size,
+			 data->bufsize);
+	usbtmc_free_pool(data, data->trig_urb, 1, USBTMC_HEADER_SIZE);
+	kfree(data->zc_out_buf);
 	usb_put_dev(data->usb_dev);
 	kfree(data);
 }
 
+static void usbtmc_trigger_group_free(struct usbtmc_device_data **group,
+				      u32 count)
+{
+	u32 i;
+
+	for (i = 0; i < count; i++)
+		if (group[i])
+			kref_put(&group[i]->kref, usbtmc_delete);
+	kfree(group);
+}
+
+static void usbtmc_ctrl_free(struct usbtmc_ctrl *ctrl)
+{
+	usb_free_urb(ctrl->urb);
+	kfree(ctrl->setup);
+	kfree(ctrl->buffer);
+	kfree(ctrl);
+}
+
 static int usbtmc_open(struct inode *inode, struct file *filp)
 {
 	struct usb_interface *intf;
@@ -195,246 +537,493 @@ static int usbtmc_open(struct inode *inode, struct file *filp)
 	file_data->TermCharEnabled = data->TermCharEnabled;
 	file_data->auto_abort = data->auto_abort;
 
+	mutex_init(&file_data->ctrl_mutex);
+	spin_lock_init(&file_data->srq_lock);
+	INIT_KFIFO(file_data->srq_queue);
+	init_waitqueue_head(&file_data->srq_waitq);
 	INIT_LIST_HEAD(&file_data->file_elem);
-	spin_lock_irq(&data->dev_lock);
-	list_add_tail(&file_data->file_elem, &data->file_list);
-	spin_unlock_irq(&data->dev_lock);
+	spin_lock(&data->dev_lock);
+	list_add_tail_rcu(&file_data->file_elem, &data->file_list);
+	spin_unlock(&data->dev_lock);
 	mutex_unlock(&data->io_mutex);
 
 	/* Store pointer in file structure's private data field */
 	filp->private_data = file_data;
 
+	/* Asynchronous reads and writes never block on the device */
+	filp->f_mode |= FMODE_NOWAIT;
+
 	return 0;
 }
 
 static int usbtmc_release(struct inode *inode, struct file *file)
 {
 	struct usbtmc_file_data *file_data = file->private_data;
+	struct eventfd_ctx *ctx = NULL;
 
 	pr_debug("%s - called\n", __func__);
 
-	/* prevent IO _AND_ usbtmc_interrupt */
+	usbtmc_stream_stop(file_data);
+
+	/* The completion handler uses file_data->data */
+	if (file_data->ctrl) {
+		usb_kill_urb(file_data->ctrl->urb);
+		usbtmc_ctrl_free(file_data->ctrl);
+		file_data->ctrl = NULL;
+	}
+
+	/* No other file may read the response to our request */
+	mutex_lock(&file_data->data->in_mutex);
+	if (file_data->data->in_owner == file_data) {
+		if (file_data->data->in_state != USBTMC_IN_IDLE)
+			usbtmc_in_cancel(file_data->data);
+		file_data->data->in_owner = NULL;
+	}
+	mutex_unlock(&file_data->data->in_mutex);
+
+	/* prevent IO */
 	mutex_lock(&file_data->data->io_mutex);
-	spin_lock_irq(&file_data->data->dev_lock);
+	spin_lock(&file_data->data->dev_lock);
 
-	list_del(&file_data->file_elem);
+	list_del_rcu(&file_data->file_elem);
 
-	spin_unlock_irq(&file_data->data->dev_lock);
+	spin_unlock(&file_data->data->dev_lock);
 	mutex_unlock(&file_data->data->io_mutex);
 
+	/*
+	 * usbtmc_interrupt() may still see file_data until a grace period
+	 * has passed. It only uses the eventfd under srq_lock, so that can
+	 * go now; the structure itself is freed after the grace period
+	 * without making close() wait for it.
+	 */
+	spin_lock_irq(&file_data->srq_lock);
+	swap(ctx, file_data->srq_eventfd);
+	spin_unlock_irq(&file_data->srq_lock);
+	if (ctx)
+		eventfd_ctx_put(ctx);
+
 	kref_put(&file_data->data->kref, usbtmc_delete);
-	file_data->data = NULL;
-	kfree(file_data);
+	kvfree(file_data->rbuf);
+	usbtmc_trigger_group_free(file_data->trig_group,
+				  file_data->trig_count);
+	kfree_rcu(file_data, rcu);
 	return 0;
 }
 
-static int usbtmc_ioctl_abort_bulk_in(struct usbtmc_device_data *data)
+/*
+ * Records the completion time of a bulk transfer. Out transfers of
+ * only a header are REQUEST_DEV_DEP_MSG_IN or TRIGGER messages and do
+ * not count as writes.
+ */
+static void usbtmc_stamp_complete(struct usbtmc_device_data *data,
+				  struct urb *urb)
 {
-	u8 *buffer;
-	struct device *dev;
-	int rv;
-	int n;
-	int actual;
-	struct usb_host_interface *current_setting;
-	int max_size;
+	if (urb->status)
+		return;
+	if (usb_urb_dir_in(urb))
+		WRITE_ONCE(data->ts.read_end, ktime_get_ns());
+	else if (urb->transfer_buffer_length != USBTMC_HEADER_SIZE)
+		WRITE_ONCE(data->ts.write_end, ktime_get_ns());
+}
 
-	dev = &data->intf->dev;
-	buffer = kmalloc(io_buffer_size, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+static void usbtmc_bulk_complete(struct urb *urb)
+{
+	struct usbtmc_urb *turb = urb->context;
+	struct usbtmc_device_data *data = turb->data;
+
+	usbtmc_stamp_complete(data, urb);
+	turb->done_ns = ktime_get_ns();
+	/* turb may be on the waiter's stack and gone once it is woken */
+	complete(&turb->done);
+	/* Readiness for poll may have changed */
+	wake_up_interruptible(&data->waitq);
+}
 
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_INITIATE_ABORT_BULK_IN,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT,
-			     data->bTag_last_read, data->bulk_in,
-			     buffer, 2, data->timeout);
+static int usbtmc_submit_bulk_urb(struct usbtmc_device_data *data,
+				  struct usbtmc_urb *turb, unsigned int pipe,
+				  size_t size, struct usb_anchor *anchor)
+{
+	int retval;
 
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
+	reinit_completion(&turb->done);
+	usb_fill_bulk_urb(turb->urb, data->usb_dev, pipe,
+			  turb->buffer, size, usbtmc_bulk_complete, turb);
+	usb_anchor_urb(turb->urb, anchor);
+	retval = usb_submit_urb(turb->urb, GFP_KERNEL);
+	if (retval) {
+		usb_unanchor_urb(turb->urb);
+		dev_err(&data->intf->dev, "usb_submit_urb returned %d\n",
+			retval);
 	}
+	return retval;
+}
 
-	dev_dbg(dev, "INITIATE_ABORT_BULK_IN returned %x\n", buffer[0]);
+/*
+ * Queues one bulk in URB of size bytes on the bulk in endpoint.
+ */
+static int usbtmc_submit_in_urb(struct usbtmc_device_data *data,
+				struct usbtmc_urb *turb, size_t size)
+{
+	return usbtmc_submit_bulk_urb(data, turb,
+			usb_rcvbulkpipe(data->usb_dev, data->bulk_in),
+			size, &data->in_anchor);
+}
 
-	if (buffer[0] == USBTMC_STATUS_FAILED) {
-		rv = 0;
-		goto exit;
-	}
+/*
+ * Queues one bulk out URB sending size bytes on the bulk out endpoint.
+ */
+static int usbtmc_submit_out_urb(struct usbtmc_device_data *data,
+				 struct usbtmc_urb *turb, size_t size)
+{
+	return usbtmc_submit_bulk_urb(data, turb,
+			usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+			size, &data->out_anchor);
+}
 
-	if (buffer[0] != USBTMC_STATUS_SUCCESS) {
-		dev_err(dev, "INITIATE_ABORT_BULK_IN returned %x\n",
-			buffer[0]);
-		rv = -EPERM;
-		goto exit;
-	}
+/*
+ * Waits up to timeout jiffies for a submitted URB to complete.
+ * Returns the URB status or a negative error when the wait timed out
+ * or the task was killed. Other signals do not end the wait: a read or
+ * write restarted after part of a message went out would resend it.
+ */
+static int usbtmc_wait_urb_timeout(struct usbtmc_urb *turb,
+				   unsigned long timeout)
+{
+	long rv;
 
-	max_size = 0;
-	current_setting = data->intf->cur_altsetting;
-	for (n = 0; n < current_setting->desc.bNumEndpoints; n++)
-		if (current_setting->endpoint[n].desc.bEndpointAddress ==
-			data->bulk_in)
-			max_size = usb_endpoint_maxp(&current_setting->endpoint[n].desc);
+	rv = wait_for_completion_killable_timeout(&turb->done, timeout);
+	if (rv < 0)
+		return rv;
+	if (rv == 0)
+		return -ETIMEDOUT;
+	return turb->urb->status;
+}
 
-	if (max_size == 0) {
-		dev_err(dev, "Couldn't get wMaxPacketSize\n");
-		rv = -EPERM;
-		goto exit;
-	}
+static int usbtmc_wait_urb(struct usbtmc_device_data *data,
+			   struct usbtmc_urb *turb)
+{
+	return usbtmc_wait_urb_timeout(turb, msecs_to_jiffies(data->timeout));
+}
 
-	dev_dbg(&data->intf->dev, "wMaxPacketSize is %d\n", max_size);
+/*
+ * Returns the timeout in jiffies for a transfer of size bytes: the usb
+ * timeout for every io_buffer_size bytes, as if the transfer was split
+ * into messages of that size.
+ */
+static unsigned long usbtmc_xfer_timeout(struct usbtmc_device_data *data,
+					 size_t size)
+{
+	unsigned long timeout = msecs_to_jiffies(data->timeout);
+	unsigned long n = DIV_ROUND_UP(size, data->bufsize);
 
-	n = 0;
+	if (n > MAX_SCHEDULE_TIMEOUT / timeout)
+		return MAX_SCHEDULE_TIMEOUT;
+	return n * timeout;
+}
 
-	do {
-		dev_dbg(dev, "Reading from bulk in EP\n");
+/*
+ * Submits a single URB of size bytes and waits for it to complete,
+ * much like usb_bulk_msg() does. The wait is bounded by
+ * usbtmc_xfer_timeout(). The URB is killed if the wait fails.
+ */
+static int usbtmc_sync_bulk_msg(struct usbtmc_device_data *data,
+				struct usbtmc_urb *turb, bool is_in,
+				size_t size, int *actual)
+{
+	int retval;
 
-		rv = usb_bulk_msg(data->usb_dev,
-				  usb_rcvbulkpipe(data->usb_dev,
-						  data->bulk_in),
-				  buffer, io_buffer_size,
-				  &actual, data->timeout);
+	if (is_in)
+		retval = usbtmc_submit_in_urb(data, turb, size);
+	else
+		retval = usbtmc_submit_out_urb(data, turb, size);
+	if (retval < 0)
+		return retval;
 
-		n++;
+	retval = usbtmc_wait_urb_timeout(turb,
+					 usbtmc_xfer_timeout(data, size));
+	if (retval < 0)
+		usb_kill_urb(turb->urb);
+	if (actual)
+		*actual = turb->urb->actual_length;
+	return retval;
+}
 
-		if (rv < 0) {
-			dev_err(dev, "usb_bulk_msg returned %d\n", rv);
-			goto exit;
-		}
-	} while ((actual == max_size) &&
-		 (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
+/*
+ * Drops the bulk out URBs in flight, e.g. before an abort or clear,
+ * including those of asynchronous writes and read requests.
+ */
+static void usbtmc_out_cancel(struct usbtmc_device_data *data)
+{
+	usb_kill_anchored_urbs(&data->out_anchor);
+	usb_kill_anchored_urbs(&data->aio_anchor);
+	WRITE_ONCE(data->out_in_flight, 0);
+}
 
-	if (actual == max_size) {
-		dev_err(dev, "Couldn't clear device buffer within %d cycles\n",
-			USBTMC_MAX_READS_TO_CLEAR_BULK_IN);
-		rv = -EPERM;
-		goto exit;
-	}
+/*
+ * Drops the response of a non-blocking or an asynchronous read. Waits
+ * until an asynchronous read has let go of in_pool[0], so that the
+ * caller can reuse it.
+ */
+static void usbtmc_in_cancel(struct usbtmc_device_data *data)
+{
+	usb_kill_anchored_urbs(&data->in_anchor);
+	WRITE_ONCE(data->in_state, USBTMC_IN_IDLE);
+	wait_event(data->waitq, !READ_ONCE(data->aio_read));
+}
+
+/*
+ * Returns true if a response started by usbtmc_in_start is pending for
+ * another file. It is kept for that file. Called with in_mutex held.
+ */
+static bool usbtmc_in_foreign(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_device_data *data = file_data->data;
 
-	n = 0;
+	return data->in_state != USBTMC_IN_IDLE &&
+	       data->in_owner != file_data;
+}
 
-usbtmc_abort_bulk_in_status:
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_CHECK_ABORT_BULK_IN_STATUS,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT,
-			     0, data->bulk_in, buffer, 0x08,
-			     data->timeout);
+/*
+ * Drops the data of all read buffers after the device discarded the
+ * rest of the message, i.e. on every abort or clear of the bulk in
+ * endpoint, also the automatic ones. Called with in_mutex held.
+ */
+static void usbtmc_rbuf_drop(struct usbtmc_device_data *data)
+{
+	struct usbtmc_file_data *file_data;
 
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
+	rcu_read_lock();
+	list_for_each_entry_rcu(file_data, &data->file_list, file_elem) {
+		file_data->rbuf_off = 0;
+		file_data->rbuf_len = 0;
 	}
+	rcu_read_unlock();
+}
 
-	dev_dbg(dev, "INITIATE_ABORT_BULK_IN returned %x\n", buffer[0]);
+/*
+ * Returns the milliseconds left until deadline, which is in jiffies.
+ */
+static unsigned int usbtmc_time_left(unsigned long deadline)
+{
+	long left = (long)(deadline - jiffies);
 
-	if (buffer[0] == USBTMC_STATUS_SUCCESS) {
-		rv = 0;
-		goto exit;
-	}
+	return left > 0 ? jiffies_to_msecs(left) : 0;
+}
 
-	if (buffer[0] != USBTMC_STATUS_PENDING) {
-		dev_err(dev, "INITIATE_ABORT_BULK_IN returned %x\n", buffer[0]);
-		rv = -EPERM;
-		goto exit;
-	}
+/*
+ * Sends a class specific control request of the abort and clear
+ * sequences, limited to the time left until deadline.
+ */
+static int usbtmc_ctrl_in(struct usbtmc_device_data *data, u8 request,
+			  u8 recipient, u16 value, u16 index, u8 *buffer,
+			  u16 len, unsigned long deadline)
+{
+	unsigned int timeout = usbtmc_time_left(deadline);
+	int rv;
 
-	if (buffer[1] == 1)
-		do {
-			dev_dbg(dev, "Reading from bulk in EP\n");
+	if (!timeout)
+		return -ETIMEDOUT;
+
+	rv = usb_control_msg(data->usb_dev,
+			     usb_rcvctrlpipe(data->usb_dev, 0),
+			     request, USB_DIR_IN | USB_TYPE_CLASS | recipient,
+			     value, index, buffer, len, timeout);
+	if (rv < 0)
+		dev_err(&data->intf->dev, "usb_control_msg returned %d\n", rv);
+	return rv;
+}
 
-			rv = usb_bulk_msg(data->usb_dev,
-					  usb_rcvbulkpipe(data->usb_dev,
-							  data->bulk_in),
-					  buffer, io_buffer_size,
-					  &actual, data->timeout);
+/*
+ * Waits before the next status check after the device reported
+ * PENDING, doubling the delay each time.
+ */
+static int usbtmc_status_backoff(unsigned int *delay, unsigned long deadline)
+{
+	unsigned int left = usbtmc_time_left(deadline);
 
-			n++;
+	if (!left)
+		return -ETIMEDOUT;
+	if (msleep_interruptible(min(*delay, left)))
+		return -EINTR;
+	*delay = min_t(unsigned int, *delay * 2, USBTMC_STATUS_POLL_MAX_MS);
+	return 0;
+}
 
-			if (rv < 0) {
-				dev_err(dev, "usb_bulk_msg returned %d\n", rv);
-				goto exit;
-			}
-		} while ((actual == max_size) &&
-			 (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
+/*
+ * Reads from the bulk in endpoint until a short packet is received.
+ * A read that gets no data within USBTMC_DRAIN_TIMEOUT is cancelled and
+ * the endpoint is considered empty.
+ */
+static int usbtmc_drain_bulk_in(struct usbtmc_device_data *data,
+				unsigned long deadline)
+{
+	struct device *dev = &data->intf->dev;
+	struct usbtmc_urb *turb = &data->in_pool[0];
+	unsigned int timeout;
+	int actual;
+	long rv;
 
-	if (actual == max_size) {
-		dev_err(dev, "Couldn't clear device buffer within %d cycles\n",
-			USBTMC_MAX_READS_TO_CLEAR_BULK_IN);
-		rv = -EPERM;
-		goto exit;
-	}
+	do {
+		timeout = min_t(unsigned int, usbtmc_time_left(deadline),
+				USBTMC_DRAIN_TIMEOUT);
+		if (!timeout) {
+			dev_err(dev, "Couldn't clear device buffer in time\n");
+			return -ETIMEDOUT;
+		}
 
-	goto usbtmc_abort_bulk_in_status;
+		dev_dbg(dev, "Reading from bulk in EP\n");
 
-exit:
-	kfree(buffer);
-	return rv;
+		rv = usbtmc_submit_in_urb(data, turb, data->bufsize);
+		if (rv < 0)
+			return rv;
+
+		rv = wait_for_completion_interruptible_timeout(&turb->done,
+				msecs_to_jiffies(timeout));
+		if (rv <= 0) {
+			usb_kill_urb(turb->urb);
+			/* Like the backoff: the sequence is not restarted */
+			if (rv < 0)
+				return -EINTR;
+		} else if (turb->urb->status) {
+			dev_err(dev, "bulk in read returned %d\n",
+				turb->urb->status);
+			return turb->urb->status;
+		}
+		actual = turb->urb->actual_length;
+	} while (actual == data->bufsize);
 
+	return 0;
 }
 
-static int usbtmc_ioctl_abort_bulk_out(struct usbtmc_device_data *data)
+static int usbtmc_ioctl_abort_bulk_in(struct usbtmc_device_data *data)
 {
-	struct device *dev;
+	unsigned long deadline = jiffies + msecs_to_jiffies(data->timeout);
+	unsigned int delay = USBTMC_STATUS_POLL_MIN_MS;
+	struct device *dev = &data->intf->dev;
 	u8 *buffer;
 	int rv;
-	int n;
 
-	dev = &data->intf->dev;
+	/* Reads in flight are killed rather than waited for */
+	usbtmc_in_cancel(data);
+	usbtmc_rbuf_drop(data);
 
 	buffer = kmalloc(8, GFP_KERNEL);
 	if (!buffer)
 		return -ENOMEM;
 
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_INITIATE_ABORT_BULK_OUT,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT,
-			     data->bTag_last_write, data->bulk_out,
-			     buffer, 2, data->timeout);
+	rv = usbtmc_ctrl_in(data, USBTMC_REQUEST_INITIATE_ABORT_BULK_IN,
+			    USB_RECIP_ENDPOINT, data->bTag_last_read,
+			    data->bulk_in, buffer, 2, deadline);
+	if (rv < 0)
+		goto exit;
 
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
+	dev_dbg(dev, "INITIATE_ABORT_BULK_IN returned %x\n", buffer[0]);
+
+	if (buffer[0] == USBTMC_STATUS_FAILED) {
+		rv = 0;
 		goto exit;
 	}
 
-	dev_dbg(dev, "INITIATE_ABORT_BULK_OUT returned %x\n", buffer[0]);
-
 	if (buffer[0] != USBTMC_STATUS_SUCCESS) {
-		dev_err(dev, "INITIATE_ABORT_BULK_OUT returned %x\n",
+		dev_err(dev, "INITIATE_ABORT_BULK_IN returned %x\n",
 			buffer[0]);
 		rv = -EPERM;
 		goto exit;
 	}
 
-	n = 0;
-
-usbtmc_abort_bulk_out_check_status:
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_CHECK_ABORT_BULK_OUT_STATUS,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_ENDPOINT,
-			     0, data->bulk_out, buffer, 0x08,
-			     data->timeout);
-	n++;
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
+	rv = usbtmc_drain_bulk_in(data, deadline);
+	if (rv < 0)
 		goto exit;
+
+	for (;;) {
+		rv = usbtmc_ctrl_in(data,
+				    USBTMC_REQUEST_CHECK_ABORT_BULK_IN_STATUS,
+				    USB_RECIP_ENDPOINT, 0, data->bulk_in,
+				    buffer, 0x08, deadline);
+		if (rv < 0)
+			goto exit;
+
+		dev_dbg(dev, "CHECK_ABORT_BULK_IN_STATUS returned %x\n",
+			buffer[0]);
+
+		if (buffer[0] == USBTMC_STATUS_SUCCESS)
+			break;
+
+		if (buffer[0] != USBTMC_STATUS_PENDING) {
+			dev_err(dev, "CHECK_ABORT_BULK_IN_STATUS returned %x\n",
+				buffer[0]);
+			rv = -EPERM;
+			goto exit;
+		}
+
+		/* bmAbortBulkIn.D0 set: the device still has data queued */
+		if (buffer[1] == 1)
+			rv = usbtmc_drain_bulk_in(data, deadline);
+		else
+			rv = usbtmc_status_backoff(&delay, deadline);
+		if (rv < 0)
+			goto exit;
 	}
+	rv = 0;
+
+exit:
+	kfree(buffer);
+	return rv;
+}
+
+static int usbtmc_ioctl_abort_bulk_out(struct usbtmc_device_data *data)
+{
+	unsigned long deadline = jiffies + msecs_to_jiffies(data->timeout);
+	unsigned int delay = USBTMC_STATUS_POLL_MIN_MS;
+	struct device *dev = &data->intf->dev;
+	u8 *buffer;
+	int rv;
+
+	/* Writes in flight are killed rather than waited for */
+	usbtmc_out_cancel(data);
 
-	dev_dbg(dev, "CHECK_ABORT_BULK_OUT returned %x\n", buffer[0]);
+	buffer = kmalloc(8, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
 
-	if (buffer[0] == USBTMC_STATUS_SUCCESS)
-		goto usbtmc_abort_bulk_out_clear_halt;
+	rv = usbtmc_ctrl_in(data, USBTMC_REQUEST_INITIATE_ABORT_BULK_OUT,
+			    USB_RECIP_ENDPOINT, data->bTag_last_write,
+			    data->bulk_out, buffer, 2, deadline);
+	if (rv < 0)
+		goto exit;
 
-	if ((buffer[0] == USBTMC_STATUS_PENDING) &&
-	    (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN))
-		goto usbtmc_abort_bulk_out_check_status;
+	dev_dbg(dev, "INITIATE_ABORT_BULK_OUT returned %x\n", buffer[0]);
 
-	rv = -EPERM;
-	goto exit;
+	if (buffer[0] != USBTMC_STATUS_SUCCESS) {
+		dev_err(dev, "INITIATE_ABORT_BULK_OUT returned %x\n",
+			buffer[0]);
+		rv = -EPERM;
+		goto exit;
+	}
+
+	for (;;) {
+		rv = usbtmc_ctrl_in(data,
+				    USBTMC_REQUEST_CHECK_ABORT_BULK_OUT_STATUS,
+				    USB_RECIP_ENDPOINT, 0, data->bulk_out,
+				    buffer, 0x08, deadline);
+		if (rv < 0)
+			goto exit;
+
+		dev_dbg(dev, "CHECK_ABORT_BULK_OUT returned %x\n", buffer[0]);
+
+		if (buffer[0] == USBTMC_STATUS_SUCCESS)
+			break;
+
+		if (buffer[0] != USBTMC_STATUS_PENDING) {
+			rv = -EPERM;
+			goto exit;
+		}
+
+		rv = usbtmc_status_backoff(&delay, deadline);
+		if (rv < 0)
+			goto exit;
+	}
 
-usbtmc_abort_bulk_out_clear_halt:
 	rv = usb_clear_halt(data->usb_dev,
 			    usb_sndbulkpipe(data->usb_dev, data->bulk_out));
 
@@ -449,26 +1038,176 @@ exit:
 	return rv;
 }
 
+/*
+ * Removes up to count queued SRQ events and copies them to the user
+ * array, oldest first. Also returns and resets the overflow counter.
+ */
+static int usbtmc488_ioctl_read_srq(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	struct usbtmc_srq_event *events;
+	struct usbtmc_srq_events req;
+	int rv = 0;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	req.count = min_t(u32, req.count, USBTMC_SRQ_QUEUE_SIZE);
+	events = kmalloc_array(max_t(u32, req.count, 1), sizeof(*events),
+			       GFP_KERNEL);
+	if (!events)
+		return -ENOMEM;
+
+	spin_lock_irq(&file_data->srq_lock);
+	req.n_events = kfifo_out(&file_data->srq_queue, events, req.count);
+	req.overflow = file_data->srq_overflow;
+	file_data->srq_overflow = 0;
+	spin_unlock_irq(&file_data->srq_lock);
+
+	if (copy_to_user(u64_to_user_ptr(req.events), events,
+			 req.n_events * sizeof(*events)) ||
+	    copy_to_user(arg, &req, sizeof(req)))
+		rv = -EFAULT;
+
+	kfree(events);
+	return rv;
+}
+
+/*
+ * Registers the eventfd that is signalled for each SRQ, replacing the
+ * previous one. A negative file descriptor unregisters it.
+ */
+static int usbtmc488_ioctl_srq_eventfd(struct usbtmc_file_data *file_data,
+				       void __user *arg)
+{
+	struct eventfd_ctx *ctx = NULL;
+	__s32 fd;
+
+	if (get_user(fd, (__s32 __user *)arg))
+		return -EFAULT;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock_irq(&file_data->srq_lock);
+	swap(ctx, file_data->srq_eventfd);
+	spin_unlock_irq(&file_data->srq_lock);
+
+	if (ctx)
+		eventfd_ctx_put(ctx);
+	return 0;
+}
+
+/*
+ * Returns the times of the last SRQ and of the last bulk transfers.
+ */
+static int usbtmc_ioctl_get_timestamps(struct usbtmc_device_data *data,
+				       void __user *arg)
+{
+	struct usbtmc_timestamps ts = {
+		.srq = READ_ONCE(data->ts.srq),
+		.write_start = READ_ONCE(data->ts.write_start),
+		.write_end = READ_ONCE(data->ts.write_end),
+		.read_start = READ_ONCE(data->ts.read_start),
+		.read_end = READ_ONCE(data->ts.read_end),
+		.srq_stb = READ_ONCE(data->ts.srq_stb),
+	};
+
+	if (copy_to_user(arg, &ts, sizeof(ts)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Looks for the oldest queued SRQ event whose status byte has a bit of
+ * mask set, or any event if mask is 0. Returns true and the event if
+ * one was found, and removes it from the queue if take is set. The
+ * other events stay queued in their order: the queue is rotated once
+ * through, which the interrupt handler cannot observe under srq_lock.
+ */
+static bool usbtmc_srq_match(struct usbtmc_file_data *file_data, u8 mask,
+			     struct usbtmc_srq_event *event, bool take)
+{
+	struct usbtmc_srq_event tmp;
+	unsigned int n;
+	bool found = false;
+
+	spin_lock_irq(&file_data->srq_lock);
+	for (n = kfifo_len(&file_data->srq_queue); n > 0; n--) {
+		if (!kfifo_get(&file_data->srq_queue, &tmp))
+			break;
+		if (!found && (!mask || (tmp.stb & mask))) {
+			found = true;
+			*event = tmp;
+			if (take)
+				continue;
+		}
+		kfifo_put(&file_data->srq_queue, tmp);
+	}
+	spin_unlock_irq(&file_data->srq_lock);
+
+	return found;
+}
+
+/*
+ * Waits up to timeout milliseconds for an SRQ whose status byte
+ * matches the mask and returns its status byte and timestamp.
+ */
+static int usbtmc488_ioctl_wait_srq(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_srq_event event;
+	struct usbtmc_wait_srq req;
+	long left;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	left = msecs_to_jiffies(req.timeout);
+	/* Another thread may take the event between the wait and here */
+	while (!usbtmc_srq_match(file_data, req.mask, &event, true)) {
+		if (READ_ONCE(data->zombie))
+			return -ENODEV;
+		if (!left)
+			return -ETIMEDOUT;
+		left = wait_event_interruptible_timeout(file_data->srq_waitq,
+			usbtmc_srq_match(file_data, req.mask, &event, false) ||
+			READ_ONCE(data->zombie),
+			left);
+		if (left < 0)
+			return left;
+	}
+
+	req.stb = event.stb;
+	req.timestamp = event.timestamp;
+	if (copy_to_user(arg, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
 static int usbtmc488_ioctl_read_stb(struct usbtmc_file_data *file_data,
 				void __user *arg)
 {
 	struct usbtmc_device_data *data = file_data->data;
 	struct device *dev = &data->intf->dev;
-	int srq_asserted = 0;
+	struct usbtmc_srq_event event;
 	u8 *buffer;
-	u8 tag;
 	__u8 stb;
 	int rv;
 
 	dev_dbg(dev, "Enter ioctl_read_stb iin_ep_present: %d\n",
 		data->iin_ep_present);
 
-	spin_lock_irq(&data->dev_lock);
-	srq_asserted = atomic_xchg(&file_data->srq_asserted, srq_asserted);
-	if (srq_asserted) {
+	spin_lock_irq(&file_data->srq_lock);
+	if (kfifo_get(&file_data->srq_queue, &event)) {
 		/* a STB with SRQ is already received */
-		stb = file_data->srq_byte;
-		spin_unlock_irq(&data->dev_lock);
+		stb = event.stb;
+		spin_unlock_irq(&file_data->srq_lock);
 		rv = put_user(stb, (__u8 __user *)arg);
 		dev_dbg(dev, "stb:0x%02x with srq received %d\n",
 			(unsigned int)stb, rv);
@@ -476,7 +1215,7 @@ static int usbtmc488_ioctl_read_stb(struct usbtmc_file_data *file_data,
 			return -EFAULT;
 		return rv;
 	}
-	spin_unlock_irq(&data->dev_lock);
+	spin_unlock_irq(&file_data->srq_lock);
 
 	buffer = kmalloc(8, GFP_KERNEL);
 	if (!buffer)
@@ -518,12 +1257,7 @@ static int usbtmc488_ioctl_read_stb(struct usbtmc_file_data *file_data,
 			goto exit;
 		}
 
-		tag = data->bNotify1 & 0x7f;
-		if (tag != data->iin_bTag) {
-			dev_err(dev, "expected bTag %x got %x\n",
-				data->iin_bTag, tag);
-		}
-
+		/* usbtmc_interrupt() only accepts the expected bTag */
 		stb = data->bNotify2;
 	} else {
 		stb = buffer[2];
@@ -602,30 +1336,22 @@ static int usbtmc488_ioctl_simple(struct usbtmc_device_data *data,
 }
 
 /*
- * Sends a TRIGGER Bulk-OUT command message
- * See the USBTMC-USB488 specification, Table 2.
+ * Fills the preallocated TRIGGER message with the next bTag and makes
+ * its URB ready to be submitted. See the USBTMC-USB488 specification,
+ * Table 2. Called with out_mutex held.
  *
  * Also updates bTag_last_write.
  */
-static int usbtmc488_ioctl_trigger(struct usbtmc_device_data *data)
+static void usbtmc_trigger_prepare(struct usbtmc_device_data *data)
 {
-	int retval;
-	u8 *buffer;
-	int actual;
-
-	buffer = kzalloc(USBTMC_HEADER_SIZE, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	struct usbtmc_urb *turb = data->trig_urb;
+	u8 *buffer = turb->buffer;
 
+	memset(buffer, 0, USBTMC_HEADER_SIZE);
 	buffer[0] = 128;
 	buffer[1] = data->bTag;
 	buffer[2] = ~data->bTag;
 
-	retval = usb_bulk_msg(data->usb_dev,
-			      usb_sndbulkpipe(data->usb_dev,
-					      data->bulk_out),
-			      buffer, USBTMC_HEADER_SIZE, &actual, data->timeout);
-
 	/* Store bTag (in case we need to abort) */
 	data->bTag_last_write = data->bTag;
 
@@ -634,39 +1360,158 @@ static int usbtmc488_ioctl_trigger(struct usbtmc_device_data *data)
 	if (!data->bTag)
 		data->bTag++;
 
-	kfree(buffer);
+	reinit_completion(&turb->done);
+	usb_fill_bulk_urb(turb->urb, data->usb_dev,
+			  usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+			  buffer, USBTMC_HEADER_SIZE, usbtmc_bulk_complete,
+			  turb);
+	usb_anchor_urb(turb->urb, &data->out_anchor);
+}
+
+/*
+ * Sends a TRIGGER message with the preallocated URB. Called with
+ * out_mutex held; io_mutex is not needed, so a trigger never waits for
+ * a control request or a read in progress.
+ */
+static int usbtmc488_ioctl_trigger(struct usbtmc_device_data *data)
+{
+	struct usbtmc_urb *turb = data->trig_urb;
+	int retval;
+
+	usbtmc_trigger_prepare(data);
+
+	retval = usb_submit_urb(turb->urb, GFP_KERNEL);
+	if (retval) {
+		usb_unanchor_urb(turb->urb);
+	} else {
+		retval = usbtmc_wait_urb(data, turb);
+		if (retval < 0)
+			usb_kill_urb(turb->urb);
+	}
+
 	if (retval < 0) {
 		dev_err(&data->intf->dev, "%s returned %d\n",
 			__func__, retval);
 		return retval;
 	}
 
+	return 0;
+}
+
+/*
+ * Cancels all bulk out URBs in flight after turb failed with error and
+ * aborts the failed message if auto_abort is set.
+ */
+static void usbtmc_out_fail(struct usbtmc_device_data *data,
+			    struct usbtmc_urb *turb, int error)
+{
+	dev_err(&data->intf->dev, "Unable to send data, error %d\n", error);
+	data->bTag_last_write = turb->bTag;
+	usbtmc_out_cancel(data);
+	if (data->auto_abort)
+		usbtmc_ioctl_abort_bulk_out(data);
+}
+
+/*
+ * Reaps the oldest bulk out URB in flight. Unless wait is set, returns
+ * -EAGAIN when it has not completed yet. Errors of URBs submitted by
+ * earlier non-blocking writes are reported here.
+ */
+static int usbtmc_out_reap(struct usbtmc_device_data *data, bool wait)
+{
+	unsigned int n = data->out_pool_size;
+	struct usbtmc_urb *turb;
+	int retval;
+
+	turb = &data->out_pool[(data->out_head + n - data->out_in_flight) % n];
+	if (!wait && !completion_done(&turb->done))
+		return -EAGAIN;
+
+	retval = usbtmc_wait_urb(data, turb);
+	WRITE_ONCE(data->out_in_flight, data->out_in_flight - 1);
+	if (retval < 0)
+		usbtmc_out_fail(data, turb, retval);
 	return retval;
 }
 
+/*
+ * Returns a free slot of the bulk out ring after reaping the completed
+ * URBs. When all slots are busy this waits for the oldest one or, if
+ * nonblock is set, returns -EAGAIN.
+ */
+static struct usbtmc_urb *usbtmc_out_get(struct usbtmc_device_data *data,
+					 bool nonblock)
+{
+	bool wait;
+	int retval;
+
+	while (data->out_in_flight > 0) {
+		wait = !nonblock && data->out_in_flight == data->out_pool_size;
+		retval = usbtmc_out_reap(data, wait);
+		if (retval == -EAGAIN)
+			break;
+		if (retval < 0)
+			return ERR_PTR(retval);
+	}
+
+	if (data->out_in_flight == data->out_pool_size)
+		return ERR_PTR(-EAGAIN);
+	return &data->out_pool[data->out_head];
+}
 
 /*
- * Sends a REQUEST_DEV_DEP_MSG_IN message on the Bulk-IN endpoint.
- * @transfer_size: number of bytes to request from the device.
- *
- * See the USBTMC specification, Table 4.
+ * Submits the message in turb, which was returned by usbtmc_out_get,
+ * and assigns it the current bTag.
  *
  * Also updates bTag_last_write.
  */
-static int send_request_dev_dep_msg_in(struct usbtmc_file_data *file_data,
-				       size_t transfer_size)
+static int usbtmc_out_submit(struct usbtmc_device_data *data,
+			     struct usbtmc_urb *turb, size_t size)
 {
-	struct usbtmc_device_data *data = file_data->data;
 	int retval;
-	u8 *buffer;
-	int actual;
 
-	buffer = kmalloc(USBTMC_HEADER_SIZE, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
-	/* Setup IO buffer for REQUEST_DEV_DEP_MSG_IN message
-	 * Refer to class specs for details
-	 */
+	retval = usbtmc_submit_out_urb(data, turb, size);
+
+	turb->bTag = data->bTag;
+	data->bTag_last_write = data->bTag;
+	data->bTag++;
+	if (!data->bTag)
+		data->bTag++;
+
+	if (retval < 0) {
+		usbtmc_out_fail(data, turb, retval);
+		return retval;
+	}
+
+	WRITE_ONCE(data->out_head, (data->out_head + 1) % data->out_pool_size);
+	WRITE_ONCE(data->out_in_flight, data->out_in_flight + 1);
+	return 0;
+}
+
+/*
+ * Waits until all URBs of the bulk out ring have completed.
+ */
+static int usbtmc_out_drain(struct usbtmc_device_data *data)
+{
+	int retval;
+
+	while (data->out_in_flight > 0) {
+		retval = usbtmc_out_reap(data, true);
+		if (retval < 0)
+			return retval;
+	}
+	return 0;
+}
+
+/*
+ * Fills buffer with a REQUEST_DEV_DEP_MSG_IN header for transfer_size
+ * bytes using the current bTag. Refer to class specs for details.
+ */
+static void usbtmc_setup_request_msg(struct usbtmc_file_data *file_data,
+				     u8 *buffer, size_t transfer_size)
+{
+	struct usbtmc_device_data *data = file_data->data;
+
 	buffer[0] = 2;
 	buffer[1] = data->bTag;
 	buffer[2] = ~data->bTag;
@@ -680,116 +1525,401 @@ static int send_request_dev_dep_msg_in(struct usbtmc_file_data *file_data,
 	buffer[9] = file_data->TermChar;
 	buffer[10] = 0; /* Reserved */
 	buffer[11] = 0; /* Reserved */
+}
 
-	/* Send bulk URB */
-	retval = usb_bulk_msg(data->usb_dev,
-			      usb_sndbulkpipe(data->usb_dev,
-					      data->bulk_out),
-			      buffer, USBTMC_HEADER_SIZE, &actual, data->timeout);
+/*
+ * Sends a REQUEST_DEV_DEP_MSG_IN message on the Bulk-IN endpoint.
+ * @transfer_size: number of bytes to request from the device.
+ * @nonblock: queue the message without waiting for it to be sent.
+ *
+ * See the USBTMC specification, Table 4.
+ *
+ * Also updates bTag_last_write. Must be called with out_mutex held.
+ */
+static int send_request_dev_dep_msg_in(struct usbtmc_file_data *file_data,
+				       size_t transfer_size, bool nonblock)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_urb *turb;
+	int retval;
 
-	/* Store bTag (in case we need to abort) */
-	data->bTag_last_write = data->bTag;
+	turb = usbtmc_out_get(data, nonblock);
+	if (IS_ERR(turb))
+		return PTR_ERR(turb);
 
-	/* Increment bTag -- and increment again if zero */
-	data->bTag++;
-	if (!data->bTag)
-		data->bTag++;
+	usbtmc_setup_request_msg(file_data, turb->buffer, transfer_size);
+	WRITE_ONCE(data->ts.read_start, ktime_get_ns());
 
-	kfree(buffer);
-	if (retval < 0)
+	/* Send bulk URB behind the messages still in flight */
+	retval = usbtmc_out_submit(data, turb, USBTMC_HEADER_SIZE);
+	if (!retval && !nonblock)
+		retval = usbtmc_out_drain(data);
+
+	if (retval < 0 && retval != -EAGAIN)
 		dev_err(&data->intf->dev, "%s returned %d\n",
 			__func__, retval);
 
 	return retval;
 }
 
-static ssize_t usbtmc_read(struct file *filp, char __user *buf,
-			   size_t count, loff_t *f_pos)
+/*
+ * Starts a read of up to one bulk in transfer without waiting for the
+ * response, which is received into in_pool[0]. The request itself is
+ * queued behind the messages in flight; if all bulk out URBs are busy
+ * this waits for the oldest one. With nonblock set it returns -EAGAIN
+ * instead, and also when a write holds out_mutex. Called with in_mutex
+ * held.
+ */
+static int usbtmc_in_start(struct usbtmc_file_data *file_data, size_t count,
+			   bool nonblock)
 {
-	struct usbtmc_file_data *file_data;
-	struct usbtmc_device_data *data;
-	struct device *dev;
-	u32 n_characters;
-	u8 *buffer;
-	int actual;
-	size_t done;
-	size_t remaining;
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_urb *turb = &data->in_pool[0];
+	struct usbtmc_urb *slot;
 	int retval;
-	size_t this_part;
 
-	/* Get pointer to private data structure */
-	file_data = filp->private_data;
-	data = file_data->data;
-	dev = &data->intf->dev;
+	count = min_t(size_t, count, data->bufsize - USBTMC_HEADER_SIZE);
 
-	buffer = kmalloc(io_buffer_size, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	/* Queue the bulk in URB first so that no data can be missed */
+	retval = usbtmc_submit_in_urb(data, turb, data->bufsize);
+	if (retval < 0)
+		return retval;
 
-	mutex_lock(&data->io_mutex);
-	if (data->zombie) {
-		retval = -ENODEV;
-		goto exit;
+	if (!nonblock) {
+		mutex_lock(&data->out_mutex);
+	} else if (!mutex_trylock(&data->out_mutex)) {
+		retval = -EAGAIN;
+		goto kill;
 	}
-
-	dev_dbg(dev, "usb_bulk_msg_in: count(%zu)\n", count);
-
-	retval = send_request_dev_dep_msg_in(file_data, count);
-
-	if (retval < 0) {
-		if (data->auto_abort)
-			usbtmc_ioctl_abort_bulk_out(data);
-		goto exit;
+	slot = usbtmc_out_get(data, nonblock);
+	if (IS_ERR(slot)) {
+		mutex_unlock(&data->out_mutex);
+		retval = PTR_ERR(slot);
+		goto kill;
 	}
+	retval = send_request_dev_dep_msg_in(file_data, count, true);
+	data->in_tag = data->bTag_last_write;
+	mutex_unlock(&data->out_mutex);
+	if (retval < 0)
+		goto kill;
 
-	/* Loop until we have fetched everything we requested */
-	remaining = count;
-	this_part = remaining;
-	done = 0;
-
-	while (remaining > 0) {
-	        /* Send bulk URB */
-		retval = usb_bulk_msg(data->usb_dev,
-				      usb_rcvbulkpipe(data->usb_dev,
-						      data->bulk_in),
-				      buffer, io_buffer_size, &actual,
-				      data->timeout);
+	data->bTag_last_read = data->in_tag;
+	data->in_count = count;
+	WRITE_ONCE(data->in_owner, file_data);
+	WRITE_ONCE(data->in_state, USBTMC_IN_QUEUED);
+	return 0;
 
-	dev_dbg(dev, "%s: bulk_msg retval(%u), actual(%d)\n",
-		__func__, retval, actual);
+kill:
+	usb_kill_urb(turb->urb);
+	return retval;
+}
 
-		/* Store bTag (in case we need to abort) */
-		data->bTag_last_read = data->bTag;
+/*
+ * Collects the response of a read started by usbtmc_in_start. Unless
+ * nonblock is set this waits for it. Called with in_mutex held.
+ */
+static int usbtmc_in_finish(struct usbtmc_device_data *data, bool nonblock)
+{
+	struct device *dev = &data->intf->dev;
+	struct usbtmc_urb *turb = &data->in_pool[0];
+	u8 *buffer = turb->buffer;
+	u32 n_characters;
+	int actual;
+	int retval;
+
+	if (nonblock && !completion_done(&turb->done))
+		return -EAGAIN;
+
+	retval = usbtmc_wait_urb(data, turb);
+	/* The task is being killed, leave the response queued */
+	if (retval == -ERESTARTSYS)
+		return retval;
+	if (retval < 0) {
+		dev_dbg(dev, "Unable to read data, error %d\n", retval);
+		goto abort_in;
+	}
+
+	actual = turb->urb->actual_length;
+	if (actual < USBTMC_HEADER_SIZE || buffer[0] != 2 ||
+	    buffer[1] != data->in_tag) {
+		dev_err(dev, "Device sent bad header for bTag %u\n",
+			data->in_tag);
+		retval = -EPROTO;
+		goto abort_in;
+	}
+
+	n_characters = buffer[4] +
+		       (buffer[5] << 8) +
+		       (buffer[6] << 16) +
+		       (buffer[7] << 24);
+
+	if (n_characters > data->in_count ||
+	    n_characters > actual - USBTMC_HEADER_SIZE) {
+		dev_err(dev, "Device sent bad length: %u\n", n_characters);
+		retval = -EPROTO;
+		goto abort_in;
+	}
+
+	data->in_data = buffer + USBTMC_HEADER_SIZE;
+	data->in_len = n_characters;
+	WRITE_ONCE(data->in_state, USBTMC_IN_BUFFERED);
+	return 0;
+
+abort_in:
+	usbtmc_in_cancel(data);
+	if (data->auto_abort)
+		usbtmc_ioctl_abort_bulk_in(data);
+	return retval;
+}
+
+/*
+ * Copies up to count bytes of a buffered response to buf.
+ */
+static ssize_t usbtmc_in_copy(struct usbtmc_device_data *data,
+			      char __user *buf, size_t count)
+{
+	count = min(count, data->in_len);
+	if (copy_to_user(buf, data->in_data, count))
+		return -EFAULT;
+
+	data->in_data += count;
+	data->in_len -= count;
+	if (!data->in_len)
+		WRITE_ONCE(data->in_state, USBTMC_IN_IDLE);
+	return count;
+}
+
+/*
+ * Receives len bytes, a multiple of wMaxPacketSize, from the bulk in
+ * endpoint directly into the user buffer ubuf. The user pages are
+ * pinned and handed to the host controller as a scatter-gather list.
+ */
+static int usbtmc_read_pinned(struct usbtmc_device_data *data,
+			      char __user *ubuf, size_t len, int *actual)
+{
+	struct device *dev = &data->intf->dev;
+	unsigned long start = (unsigned long)ubuf;
+	unsigned int offset = offset_in_page(start);
+	int n_pages = DIV_ROUND_UP(offset + len, PAGE_SIZE);
+	struct usbtmc_urb zc_urb;
+	struct page **pages;
+	struct sg_table sgt;
+	int pinned;
+	int retval;
+	int i;
+
+	*actual = 0;
+
+	zc_urb.urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!zc_urb.urb)
+		return -ENOMEM;
+	zc_urb.buffer = NULL;
+	zc_urb.data = data;
+	init_completion(&zc_urb.done);
+
+	pages = kvmalloc_array(n_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		retval = -ENOMEM;
+		goto free_urb;
+	}
+
+	pinned = get_user_pages_fast(start, n_pages, FOLL_WRITE, pages);
+	if (pinned < n_pages) {
+		retval = -EFAULT;
+		goto unpin;
+	}
+
+	retval = sg_alloc_table_from_pages(&sgt, pages, n_pages, offset, len,
+					   GFP_KERNEL);
+	if (retval)
+		goto unpin;
+
+	if (sgt.nents > data->usb_dev->bus->sg_tablesize) {
+		dev_err(dev, "too many sg entries: %u\n", sgt.nents);
+		retval = -EINVAL;
+		goto free_table;
+	}
+
+	zc_urb.urb->sg = sgt.sgl;
+	zc_urb.urb->num_sgs = sgt.nents;
+	retval = usbtmc_sync_bulk_msg(data, &zc_urb, true, len, actual);
+
+	dev_dbg(dev, "%s: len(%zu) pages(%d) sgs(%u) actual(%d) retval(%d)\n",
+		__func__, len, n_pages, sgt.nents, *actual, retval);
+
+free_table:
+	sg_free_table(&sgt);
+unpin:
+	for (i = 0; i < pinned; i++) {
+		set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+	kvfree(pages);
+free_urb:
+	usb_free_urb(zc_urb.urb);
+	return retval;
+}
+
+/*
+ * Checks whether a read of count bytes into buf can use
+ * usbtmc_read_pinned() for the data following the first bulk in URB.
+ */
+static bool usbtmc_zero_copy_read(struct usbtmc_file_data *file_data,
+				  char __user *buf, size_t count)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usb_bus *bus = data->usb_dev->bus;
+	unsigned long start;
+
+	if (!file_data->zc_read_threshold ||
+	    count < file_data->zc_read_threshold ||
+	    count <= data->bufsize || !bus->sg_tablesize)
+		return false;
+
+	if (bus->no_sg_constraint)
+		return true;
+
+	/*
+	 * Without SG support for arbitrary lengths every page but the last
+	 * one must hold a multiple of wMaxPacketSize.
+	 */
+	start = (unsigned long)buf + data->bufsize - USBTMC_HEADER_SIZE;
+	return (start % data->bulk_in_maxp) == 0;
+}
+
+/*
+ * Copies len bytes of received data to offset off of the destination,
+ * which is the user buffer ubuf or, if ubuf is NULL, the kernel
+ * buffer kbuf.
+ */
+static int usbtmc_copy_in(char __user *ubuf, u8 *kbuf, size_t off,
+			  const u8 *src, size_t len)
+{
+	if (!ubuf) {
+		memcpy(kbuf + off, src, len);
+		return 0;
+	}
+	if (copy_to_user(ubuf + off, src, len))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Reads a message of up to count bytes from the device into the user
+ * buffer ubuf or, if ubuf is NULL, into the kernel buffer kbuf. Up to
+ * in_urbs bulk in URBs are kept queued on the bulk in endpoint so that
+ * the device can send the next packets while the data of a completed
+ * URB is copied. If attributes is not NULL it receives the
+ * bmTransferAttributes of the message.
+ *
+ * Must be called with in_mutex held.
+ */
+static ssize_t usbtmc_read_message(struct usbtmc_file_data *file_data,
+				   char __user *ubuf, u8 *kbuf, size_t count,
+				   u8 *attributes)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct device *dev = &data->intf->dev;
+	struct usbtmc_urb *urbs;
+	struct usbtmc_urb *turb;
+	unsigned int n_urbs;
+	unsigned int head;
+	unsigned int i;
+	u32 n_characters;
+	u8 *buffer;
+	u8 tag;
+	int actual;
+	size_t urb_size;
+	size_t submitted;
+	size_t expected;
+	size_t done;
+	size_t remaining;
+	int retval;
+	size_t this_part;
+	size_t zc_len;
+	bool first;
+	bool short_packet;
+	bool zero_copy;
+
+	urbs = data->in_pool;
+	n_urbs = data->in_pool_size;
+	urb_size = data->bufsize;
+
+	/*
+	 * A zero copy read only queues the first URB: the rest of the
+	 * message must land in the user pages.
+	 */
+	zero_copy = ubuf && usbtmc_zero_copy_read(file_data, ubuf, count);
+	if (zero_copy)
+		n_urbs = 1;
+
+	dev_dbg(dev, "usb_bulk_msg_in: count(%zu)\n", count);
+
+	mutex_lock(&data->out_mutex);
+	retval = send_request_dev_dep_msg_in(file_data, count, false);
+	tag = data->bTag_last_write;
+	mutex_unlock(&data->out_mutex);
+
+	if (retval < 0)
+		return retval;
+
+	/* Store bTag (in case we need to abort) */
+	data->bTag_last_read = tag;
+
+	/* Loop until we have fetched everything we requested */
+	remaining = count;
+	this_part = remaining;
+	done = 0;
+	first = true;
+
+	/* Header, data and up to 3 alignment bytes */
+	expected = roundup(USBTMC_HEADER_SIZE + count, 4);
+	submitted = 0;
+
+	for (i = 0; i < n_urbs && remaining > 0 && submitted < expected; i++) {
+		retval = usbtmc_submit_in_urb(data, &urbs[i], urb_size);
+		if (retval < 0)
+			goto exit;
+		submitted += urb_size;
+	}
+
+	head = 0;
+	while (remaining > 0) {
+		turb = &urbs[head];
+		buffer = turb->buffer;
+
+		retval = usbtmc_wait_urb(data, turb);
+		actual = turb->urb->actual_length;
+
+		dev_dbg(dev, "%s: bulk_msg retval(%d), actual(%d)\n",
+			__func__, retval, actual);
 
 		if (retval < 0) {
 			dev_dbg(dev, "Unable to read data, error %d\n", retval);
-			if (data->auto_abort)
-				usbtmc_ioctl_abort_bulk_in(data);
-			goto exit;
+			goto abort_in;
 		}
 
+		/* A short packet terminates the transfer */
+		short_packet = actual < urb_size;
+
 		/* Parse header in first packet */
-		if (done == 0) {
+		if (first) {
+			first = false;
+
 			/* Sanity checks for the header */
 			if (actual < USBTMC_HEADER_SIZE) {
 				dev_err(dev, "Device sent too small first packet: %u < %u\n", actual, USBTMC_HEADER_SIZE);
-				if (data->auto_abort)
-					usbtmc_ioctl_abort_bulk_in(data);
-				goto exit;
+				goto abort_in;
 			}
 
 			if (buffer[0] != 2) {
 				dev_err(dev, "Device sent reply with wrong MsgID: %u != 2\n", buffer[0]);
-				if (data->auto_abort)
-					usbtmc_ioctl_abort_bulk_in(data);
-				goto exit;
+				goto abort_in;
 			}
 
-			if (buffer[1] != data->bTag_last_write) {
-				dev_err(dev, "Device sent reply with wrong bTag: %u != %u\n", buffer[1], data->bTag_last_write);
-				if (data->auto_abort)
-					usbtmc_ioctl_abort_bulk_in(data);
-				goto exit;
+			if (buffer[1] != tag) {
+				dev_err(dev, "Device sent reply with wrong bTag: %u != %u\n", buffer[1], tag);
+				goto abort_in;
 			}
 
 			/* How many characters did the instrument send? */
@@ -798,194 +1928,1535 @@ static ssize_t usbtmc_read(struct file *filp, char __user *buf,
 				       (buffer[6] << 16) +
 				       (buffer[7] << 24);
 
-			if (n_characters > this_part) {
-				dev_err(dev, "Device wants to return more data than requested: %u > %zu\n", n_characters, count);
-				if (data->auto_abort)
-					usbtmc_ioctl_abort_bulk_in(data);
-				goto exit;
-			}
+			if (n_characters > this_part) {
+				dev_err(dev, "Device wants to return more data than requested: %u > %zu\n", n_characters, count);
+				goto abort_in;
+			}
+
+			if (attributes)
+				*attributes = buffer[8];
+
+			/* No need to queue URBs beyond the announced message */
+			expected = roundup(USBTMC_HEADER_SIZE + n_characters, 4);
+
+			/* Remove the USBTMC header */
+			actual -= USBTMC_HEADER_SIZE;
+
+			/* Check if the message is smaller than requested */
+			if (remaining > n_characters)
+				remaining = n_characters;
+			/* Remove padding if it exists */
+			if (actual > remaining)
+				actual = remaining;
+
+			dev_dbg(dev, "Bulk-IN header: N_characters(%u), bTransAttr(%u)\n", n_characters, buffer[8]);
+
+			remaining -= actual;
+
+			/* Terminate if end-of-message bit received from device */
+			if ((buffer[8] & 0x01) && (actual >= n_characters))
+				remaining = 0;
+
+			dev_dbg(dev, "Bulk-IN header: remaining(%zu), buffer(%p) done(%zu)\n", remaining, buffer, done);
+
+			buffer += USBTMC_HEADER_SIZE;
+		}
+		else  {
+			if (actual > remaining)
+				actual = remaining;
+
+			remaining -= actual;
+
+			dev_dbg(dev, "Bulk-IN header cont: actual(%u), done(%zu), remaining(%zu), buffer(%p)\n", actual, done, remaining, buffer);
+		}
+
+		if (short_packet)
+			remaining = 0;
+
+		retval = usbtmc_copy_in(ubuf, kbuf, done, buffer, actual);
+		if (retval < 0)
+			goto exit;
+		done += actual;
+
+		/*
+		 * Reuse the URB only now that its data has been taken; the
+		 * other queued URBs kept the endpoint busy during the copy.
+		 */
+		if (remaining > 0 && submitted < expected && !zero_copy) {
+			retval = usbtmc_submit_in_urb(data, turb, urb_size);
+			if (retval < 0)
+				goto abort_in;
+			submitted += urb_size;
+		}
+
+		/*
+		 * Receive the whole packets following the first URB straight
+		 * into user memory; the last packet with the alignment bytes
+		 * goes through the pool buffer again.
+		 */
+		if (zero_copy) {
+			zero_copy = false;
+			zc_len = rounddown(remaining, data->bulk_in_maxp);
+			if (zc_len > 0) {
+				retval = usbtmc_read_pinned(data, ubuf + done,
+							    zc_len, &actual);
+				if (retval < 0)
+					goto abort_in;
+				submitted += zc_len;
+				done += actual;
+				remaining -= actual;
+				if (actual < zc_len)
+					remaining = 0;
+			}
+			if (remaining > 0 && submitted < expected) {
+				retval = usbtmc_submit_in_urb(data, turb,
+							      urb_size);
+				if (retval < 0)
+					goto abort_in;
+				submitted += urb_size;
+			}
+		}
+
+		head = (head + 1) % n_urbs;
+	}
+
+	retval = done;
+	goto exit;
+
+abort_in:
+	usb_kill_anchored_urbs(&data->in_anchor);
+	if (data->auto_abort)
+		usbtmc_ioctl_abort_bulk_in(data);
+exit:
+	/* Drop URBs that were queued beyond the end of the message */
+	usb_kill_anchored_urbs(&data->in_anchor);
+	return retval;
+}
+
+/*
+ * Copies up to count leftover bytes of a buffered read to buf.
+ */
+static ssize_t usbtmc_rbuf_copy(struct usbtmc_file_data *file_data,
+				char __user *buf, size_t count)
+{
+	count = min_t(size_t, count, file_data->rbuf_len);
+	if (copy_to_user(buf, file_data->rbuf + file_data->rbuf_off, count))
+		return -EFAULT;
+
+	file_data->rbuf_off += count;
+	file_data->rbuf_len -= count;
+	return count;
+}
+
+/*
+ * Reads up to rbuf_size bytes into the read buffer and returns the
+ * first count of them. The rest is kept for the following reads, so
+ * that small reads do not each cost a USB transaction.
+ */
+static ssize_t usbtmc_read_buffered(struct usbtmc_file_data *file_data,
+				    char __user *buf, size_t count)
+{
+	ssize_t retval;
+
+	retval = usbtmc_read_message(file_data, NULL, file_data->rbuf,
+				     file_data->rbuf_size, NULL);
+	if (retval <= 0)
+		return retval;
+
+	file_data->rbuf_off = 0;
+	file_data->rbuf_len = retval;
+	return usbtmc_rbuf_copy(file_data, buf, count);
+}
+
+static ssize_t usbtmc_read(struct file *filp, char __user *buf,
+			   size_t count, loff_t *f_pos)
+{
+	struct usbtmc_file_data *file_data;
+	struct usbtmc_device_data *data;
+	ssize_t retval;
+	bool nonblock;
+
+	/* Get pointer to private data structure */
+	file_data = filp->private_data;
+	data = file_data->data;
+	nonblock = filp->f_flags & O_NONBLOCK;
+
+	if (nonblock) {
+		if (!mutex_trylock(&data->in_mutex))
+			return -EAGAIN;
+	} else {
+		mutex_lock(&data->in_mutex);
+	}
+
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	/* The bulk in endpoint belongs to the streaming thread */
+	if (rcu_access_pointer(data->stream)) {
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	/* Wait until a pending asynchronous read releases the endpoint */
+	while (data->aio_read) {
+		if (nonblock) {
+			retval = -EAGAIN;
+			goto exit;
+		}
+		mutex_unlock(&data->in_mutex);
+		if (wait_event_interruptible(data->waitq,
+					     !READ_ONCE(data->aio_read)))
+			return -ERESTARTSYS;
+		mutex_lock(&data->in_mutex);
+		if (data->zombie) {
+			retval = -ENODEV;
+			goto exit;
+		}
+	}
+
+	/* The response to another file's request is not ours to take */
+	if (usbtmc_in_foreign(file_data)) {
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	/* Leftover bytes of a buffered read come first */
+	if (file_data->rbuf_len) {
+		retval = usbtmc_rbuf_copy(file_data, buf, count);
+		goto update_pos;
+	}
+
+	/*
+	 * A non-blocking read sends the request and returns; the response
+	 * is picked up by the next read once poll reports POLLIN.
+	 */
+	if (nonblock && data->in_state == USBTMC_IN_IDLE) {
+		retval = usbtmc_in_start(file_data, count, true);
+		if (!retval)
+			retval = -EAGAIN;
+		goto exit;
+	}
+
+	if (data->in_state == USBTMC_IN_QUEUED) {
+		retval = usbtmc_in_finish(data, nonblock);
+		if (retval < 0)
+			goto exit;
+	}
+
+	if (data->in_state == USBTMC_IN_BUFFERED)
+		retval = usbtmc_in_copy(data, buf, count);
+	else if (count < file_data->rbuf_size)
+		retval = usbtmc_read_buffered(file_data, buf, count);
+	else
+		retval = usbtmc_read_message(file_data, buf, NULL, count,
+					     NULL);
+
+update_pos:
+	/* Update file position value */
+	if (retval > 0)
+		*f_pos = *f_pos + retval;
+exit:
+	mutex_unlock(&data->in_mutex);
+	return retval;
+}
+
+static void usbtmc_stream_delete(struct kref *kref)
+{
+	struct usbtmc_stream *stream;
+
+	stream = container_of(kref, struct usbtmc_stream, kref);
+	vfree(stream->mem);
+	kfree(stream);
+}
+
+/*
+ * Returns the ring offset for a record of rec_len bytes or -ENOSPC when
+ * the application has not yet consumed enough records. A wrap record is
+ * written when the record does not fit before the end of the ring.
+ */
+static int usbtmc_stream_reserve(struct usbtmc_stream *stream, u32 rec_len)
+{
+	struct usbtmc_stream_rec *rec;
+	u32 head = stream->head;
+	u32 tail = smp_load_acquire(&stream->ctrl->tail);
+
+	if (tail >= stream->size || tail % 8)
+		return -EINVAL;
+
+	/* head must not catch up with tail: that means an empty ring */
+	if (head < tail)
+		return head + rec_len < tail ? head : -ENOSPC;
+
+	if (head + rec_len < stream->size ||
+	    (head + rec_len == stream->size && tail > 0))
+		return head;
+
+	if (rec_len >= tail)
+		return -ENOSPC;
+
+	rec = (struct usbtmc_stream_rec *)(stream->ring + head);
+	rec->len = 0;
+	rec->flags = USBTMC_STREAM_REC_WRAP;
+	WRITE_ONCE(stream->head, 0);
+	smp_store_release(&stream->ctrl->head, 0);
+	return 0;
+}
+
+/*
+ * Publishes the record at offset off that holds len data bytes.
+ */
+static void usbtmc_stream_commit(struct usbtmc_stream *stream, u32 off,
+				 u32 len, u32 flags)
+{
+	struct usbtmc_stream_rec *rec;
+	u32 head;
+
+	rec = (struct usbtmc_stream_rec *)(stream->ring + off);
+	rec->len = len;
+	rec->flags = flags;
+
+	head = off + sizeof(*rec) + roundup(len, 8);
+	if (head == stream->size)
+		head = 0;
+	WRITE_ONCE(stream->head, head);
+	smp_store_release(&stream->ctrl->head, head);
+}
+
+/*
+ * Streaming thread: reads one message after the other into the ring
+ * until it is stopped or an error occurs. in_mutex is only held for
+ * one message at a time, so ioctls can be interleaved.
+ */
+static int usbtmc_stream_thread(void *arg)
+{
+	struct usbtmc_stream *stream = arg;
+	struct usbtmc_file_data *file_data = stream->file_data;
+	struct usbtmc_device_data *data = file_data->data;
+	unsigned int delay = USBTMC_STREAM_POLL_MIN_MS;
+	u32 rec_len;
+	ssize_t retval = 0;
+	u8 attributes;
+	u32 tail;
+	int off;
+
+	rec_len = sizeof(struct usbtmc_stream_rec) +
+		roundup(stream->transfer_size, 8);
+
+	while (!kthread_should_stop()) {
+		tail = READ_ONCE(stream->ctrl->tail);
+		off = usbtmc_stream_reserve(stream, rec_len);
+		if (off == -ENOSPC) {
+			/* The application polls once it has made room */
+			wait_event_interruptible_timeout(stream->space_waitq,
+				kthread_should_stop() ||
+				READ_ONCE(stream->ctrl->tail) != tail,
+				msecs_to_jiffies(delay));
+			delay = min_t(unsigned int, delay * 2,
+				      USBTMC_STREAM_POLL_MAX_MS);
+			continue;
+		}
+		delay = USBTMC_STREAM_POLL_MIN_MS;
+		if (off < 0) {
+			retval = off;
+			break;
+		}
+
+		attributes = 0;
+		mutex_lock(&data->in_mutex);
+		if (data->zombie)
+			retval = -ENODEV;
+		else if (rcu_access_pointer(data->stream) != stream)
+			retval = -ECANCELED;
+		else
+			retval = usbtmc_read_message(file_data, NULL,
+					stream->ring + off +
+					sizeof(struct usbtmc_stream_rec),
+					stream->transfer_size, &attributes);
+		mutex_unlock(&data->in_mutex);
+
+		if (retval < 0)
+			break;
+
+		usbtmc_stream_commit(stream, off, retval,
+				     (attributes & 0x01) ?
+				     USBTMC_STREAM_REC_EOM : 0);
+		wake_up_interruptible(&data->waitq);
+	}
+
+	if (retval < 0 && retval != -ECANCELED) {
+		dev_dbg(&data->intf->dev, "stream stopped: %zd\n", retval);
+		stream->ctrl->error = retval;
+		stream->ctrl->flags |= USBTMC_STREAM_STOPPED;
+		wake_up_interruptible(&data->waitq);
+	}
+
+	/* kthread_stop() needs the thread to stay around */
+	wait_event_interruptible(data->waitq, kthread_should_stop());
+	return 0;
+}
+
+/*
+ * Starts streaming messages into a ring that is mapped with mmap().
+ * Called with io_mutex and in_mutex held.
+ */
+static int usbtmc_ioctl_stream_start(struct usbtmc_file_data *file_data,
+				     void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_stream_config config;
+	struct usbtmc_stream *stream;
+	int rv;
+
+	if (copy_from_user(&config, arg, sizeof(config)))
+		return -EFAULT;
+
+	if (!config.ring_size || config.ring_size % PAGE_SIZE ||
+	    config.ring_size > USBTMC_STREAM_MAX_RING ||
+	    !config.transfer_size ||
+	    sizeof(struct usbtmc_stream_rec) +
+	    roundup(config.transfer_size, 8) >= config.ring_size)
+		return -EINVAL;
+
+	if (rcu_access_pointer(data->stream) || data->aio_read ||
+	    data->in_state != USBTMC_IN_IDLE)
+		return -EBUSY;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		return -ENOMEM;
+	kref_init(&stream->kref);
+	init_waitqueue_head(&stream->space_waitq);
+
+	stream->mem = vmalloc_user(PAGE_SIZE + config.ring_size);
+	if (!stream->mem) {
+		kfree(stream);
+		return -ENOMEM;
+	}
+
+	stream->file_data = file_data;
+	stream->ctrl = stream->mem;
+	stream->ring = (u8 *)stream->mem + PAGE_SIZE;
+	stream->size = config.ring_size;
+	stream->transfer_size = config.transfer_size;
+	stream->ctrl->size = config.ring_size;
+
+	stream->thread = kthread_run(usbtmc_stream_thread, stream,
+				     "usbtmc%d-stream", data->intf->minor);
+	if (IS_ERR(stream->thread)) {
+		rv = PTR_ERR(stream->thread);
+		kref_put(&stream->kref, usbtmc_stream_delete);
+		return rv;
+	}
+
+	rcu_assign_pointer(data->stream, stream);
+	return 0;
+}
+
+/*
+ * Stops the streaming thread started on this file. Must be called
+ * without in_mutex held since the thread may be waiting for it.
+ */
+static int usbtmc_stream_stop(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_stream *stream;
+
+	mutex_lock(&data->io_mutex);
+	mutex_lock(&data->in_mutex);
+	stream = rcu_dereference_protected(data->stream,
+					   lockdep_is_held(&data->in_mutex));
+	if (stream && stream->file_data == file_data)
+		RCU_INIT_POINTER(data->stream, NULL);
+	else
+		stream = NULL;
+	mutex_unlock(&data->in_mutex);
+	mutex_unlock(&data->io_mutex);
+
+	if (!stream)
+		return -EINVAL;
+
+	/* Wait for usbtmc_poll and usbtmc_mmap to let go of the stream */
+	synchronize_rcu();
+
+	kthread_stop(stream->thread);
+	stream->ctrl->flags |= USBTMC_STREAM_STOPPED;
+	wake_up_interruptible(&data->waitq);
+	kref_put(&stream->kref, usbtmc_stream_delete);
+	return 0;
+}
+
+static void usbtmc_stream_vm_open(struct vm_area_struct *vma)
+{
+	struct usbtmc_stream *stream = vma->vm_private_data;
+
+	kref_get(&stream->kref);
+}
+
+static void usbtmc_stream_vm_close(struct vm_area_struct *vma)
+{
+	struct usbtmc_stream *stream = vma->vm_private_data;
+
+	kref_put(&stream->kref, usbtmc_stream_delete);
+}
+
+static const struct vm_operations_struct usbtmc_stream_vm_ops = {
+	.open	= usbtmc_stream_vm_open,
+	.close	= usbtmc_stream_vm_close,
+};
+
+/*
+ * Maps the control page and the ring of the stream started on this file.
+ * Called with mmap_sem held, so it must not take io_mutex: the stream is
+ * looked up under RCU instead.
+ */
+static int usbtmc_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct usbtmc_file_data *file_data = filp->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_stream *stream;
+	int rv;
+
+	rcu_read_lock();
+	stream = rcu_dereference(data->stream);
+	if (stream && stream->file_data == file_data)
+		kref_get(&stream->kref);
+	else
+		stream = NULL;
+	rcu_read_unlock();
+
+	if (!stream)
+		return -EINVAL;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + stream->size) {
+		rv = -EINVAL;
+		goto put;
+	}
+
+	rv = remap_vmalloc_range(vma, stream->mem, 0);
+	if (rv)
+		goto put;
+
+	/* The reference is dropped by usbtmc_stream_vm_close() */
+	vma->vm_private_data = stream;
+	vma->vm_ops = &usbtmc_stream_vm_ops;
+	return 0;
+
+put:
+	kref_put(&stream->kref, usbtmc_stream_delete);
+	return rv;
+}
+
+/*
+ * Sends count bytes from the user buffer ubuf as one DEV_DEP_MSG_OUT
+ * message without copying the data. The header and the alignment bytes
+ * come from zc_out_buf, the data from the pinned user pages.
+ *
+ * Also updates bTag_last_write.
+ */
+static ssize_t usbtmc_write_pinned(struct usbtmc_device_data *data,
+				   const char __user *ubuf, size_t count)
+{
+	struct device *dev = &data->intf->dev;
+	unsigned long start = (unsigned long)ubuf;
+	unsigned int offset = offset_in_page(start);
+	int n_pages = DIV_ROUND_UP(offset + count, PAGE_SIZE);
+	u8 *buffer = data->zc_out_buf;
+	struct usbtmc_urb zc_urb;
+	struct scatterlist *sg;
+	struct page **pages;
+	struct sg_table sgt;
+	unsigned int n_pad;
+	unsigned int len;
+	size_t left;
+	int pinned;
+	int retval;
+	int i;
+
+	zc_urb.urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!zc_urb.urb)
+		return -ENOMEM;
+	zc_urb.buffer = NULL;
+	zc_urb.data = data;
+	init_completion(&zc_urb.done);
+
+	pages = kvmalloc_array(n_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		retval = -ENOMEM;
+		goto free_urb;
+	}
+
+	pinned = get_user_pages_fast(start, n_pages, 0, pages);
+	if (pinned < n_pages) {
+		retval = -EFAULT;
+		goto unpin;
+	}
+
+	n_pad = roundup(USBTMC_HEADER_SIZE + count, 4) -
+		(USBTMC_HEADER_SIZE + count);
+
+	retval = sg_alloc_table(&sgt, n_pages + 1 + (n_pad ? 1 : 0),
+				GFP_KERNEL);
+	if (retval)
+		goto unpin;
+
+	if (sgt.nents > data->usb_dev->bus->sg_tablesize) {
+		dev_err(dev, "too many sg entries: %u\n", sgt.nents);
+		retval = -EINVAL;
+		goto free_table;
+	}
+
+	/* Setup header for DEV_DEP_MSG_OUT message */
+	buffer[0] = 1;
+	buffer[1] = data->bTag;
+	buffer[2] = ~data->bTag;
+	buffer[3] = 0; /* Reserved */
+	buffer[4] = count >> 0;
+	buffer[5] = count >> 8;
+	buffer[6] = count >> 16;
+	buffer[7] = count >> 24;
+	buffer[8] = data->eom_val;
+	buffer[9] = 0; /* Reserved */
+	buffer[10] = 0; /* Reserved */
+	buffer[11] = 0; /* Reserved */
+	/* buffer[12..15] stay zero and provide the alignment bytes */
+
+	sg = sgt.sgl;
+	sg_set_buf(sg, buffer, USBTMC_HEADER_SIZE);
+	left = count;
+	for (i = 0; i < n_pages; i++) {
+		sg = sg_next(sg);
+		len = min_t(size_t, left, PAGE_SIZE - offset);
+		sg_set_page(sg, pages[i], len, offset);
+		left -= len;
+		offset = 0;
+	}
+	if (n_pad) {
+		sg = sg_next(sg);
+		sg_set_buf(sg, buffer + USBTMC_HEADER_SIZE, n_pad);
+	}
+
+	zc_urb.urb->sg = sgt.sgl;
+	zc_urb.urb->num_sgs = sgt.nents;
+	WRITE_ONCE(data->ts.write_start, ktime_get_ns());
+	retval = usbtmc_sync_bulk_msg(data, &zc_urb, false,
+				      USBTMC_HEADER_SIZE + count + n_pad,
+				      NULL);
+
+	dev_dbg(dev, "%s: count(%zu) pages(%d) sgs(%u) retval(%d)\n",
+		__func__, count, n_pages, sgt.nents, retval);
+
+	data->bTag_last_write = data->bTag;
+	data->bTag++;
+	if (!data->bTag)
+		data->bTag++;
+
+	if (retval < 0) {
+		dev_err(dev, "Unable to send data, error %d\n", retval);
+		if (data->auto_abort)
+			usbtmc_ioctl_abort_bulk_out(data);
+	} else {
+		retval = count;
+	}
+
+free_table:
+	sg_free_table(&sgt);
+unpin:
+	for (i = 0; i < pinned; i++)
+		put_page(pages[i]);
+	kvfree(pages);
+free_urb:
+	usb_free_urb(zc_urb.urb);
+	return retval;
+}
+
+/*
+ * Checks whether a write of count bytes can use usbtmc_write_pinned().
+ * The header and alignment entries of the scatter-gather list are not
+ * packet sized, so the host controller must not have SG constraints.
+ */
+static bool usbtmc_zero_copy_write(struct usbtmc_file_data *file_data,
+				   size_t count)
+{
+	struct usb_bus *bus = file_data->data->usb_dev->bus;
+
+	return file_data->zc_write_threshold &&
+		count >= file_data->zc_write_threshold &&
+		count <= U32_MAX &&
+		bus->sg_tablesize && bus->no_sg_constraint;
+}
+
+/*
+ * Queues the data as a sequence of DEV_DEP_MSG_OUT messages on the bulk
+ * out ring. Up to out_urbs messages are kept in flight so that the next
+ * message is copied from user space while the previous ones are being
+ * transferred. When all URBs are busy this waits for the oldest one or,
+ * if nonblock is set, returns the number of bytes queued so far or
+ * -EAGAIN. The messages may still be in flight on return.
+ *
+ * Must be called with out_mutex held.
+ */
+static ssize_t usbtmc_write_message(struct usbtmc_file_data *file_data,
+				    const char __user *buf, size_t count,
+				    bool nonblock)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_urb *turb;
+	u8 *buffer;
+	int retval;
+	unsigned long int n_bytes;
+	int remaining;
+	int done;
+	int this_part;
+
+	remaining = count;
+	done = 0;
+	WRITE_ONCE(data->ts.write_start, ktime_get_ns());
+
+	while (remaining > 0) {
+		/* Waits for the oldest message if all URBs are busy */
+		turb = usbtmc_out_get(data, nonblock);
+		if (IS_ERR(turb)) {
+			retval = PTR_ERR(turb);
+			if (retval == -EAGAIN && done > 0)
+				return done;
+			return retval;
+		}
+		buffer = turb->buffer;
+
+		if (remaining > data->bufsize - USBTMC_HEADER_SIZE) {
+			this_part = data->bufsize - USBTMC_HEADER_SIZE;
+			buffer[8] = 0;
+		} else {
+			this_part = remaining;
+			buffer[8] = data->eom_val;
+		}
+
+		/* Setup IO buffer for DEV_DEP_MSG_OUT message */
+		buffer[0] = 1;
+		buffer[1] = data->bTag;
+		buffer[2] = ~data->bTag;
+		buffer[3] = 0; /* Reserved */
+		buffer[4] = this_part >> 0;
+		buffer[5] = this_part >> 8;
+		buffer[6] = this_part >> 16;
+		buffer[7] = this_part >> 24;
+		/* buffer[8] is set above... */
+		buffer[9] = 0; /* Reserved */
+		buffer[10] = 0; /* Reserved */
+		buffer[11] = 0; /* Reserved */
+
+		if (copy_from_user(&buffer[USBTMC_HEADER_SIZE], buf + done, this_part))
+			return -EFAULT;
+
+		n_bytes = roundup(USBTMC_HEADER_SIZE + this_part, 4);
+		memset(buffer + USBTMC_HEADER_SIZE + this_part, 0, n_bytes - (USBTMC_HEADER_SIZE + this_part));
+
+		retval = usbtmc_out_submit(data, turb, n_bytes);
+		if (retval < 0)
+			return retval;
+
+		remaining -= this_part;
+		done += this_part;
+	}
+
+	return count;
+}
+
+/*
+ * Checks whether the count bytes in buf end a query, i.e. end with '?'
+ * optionally followed by a newline.
+ */
+static bool usbtmc_is_query(const char __user *buf, size_t count)
+{
+	char tail[2] = { 0, 0 };
+	size_t n = min_t(size_t, count, 2);
+
+	if (!n || copy_from_user(tail + 2 - n, buf + count - n, n))
+		return false;
+
+	return tail[1] == '?' || (tail[1] == '\n' && tail[0] == '?');
+}
+
+/*
+ * Sends the REQUEST_DEV_DEP_MSG_IN for the response to a query right
+ * after it was written, so that the response is already buffered in
+ * in_pool[0] when the application reads it. Skipped when a read is
+ * in progress, which sends its own request, and after a non-blocking
+ * write when the request cannot be queued without waiting.
+ */
+static void usbtmc_prefetch(struct usbtmc_file_data *file_data,
+			    bool nonblock)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	int retval;
+
+	if (!mutex_trylock(&data->in_mutex))
+		return;
+
+	if (!data->zombie && !rcu_access_pointer(data->stream) &&
+	    !data->aio_read && data->in_state == USBTMC_IN_IDLE) {
+		retval = usbtmc_in_start(file_data, file_data->prefetch_size,
+					 nonblock);
+		if (retval < 0 && retval != -EAGAIN)
+			dev_dbg(&data->intf->dev, "prefetch failed: %d\n",
+				retval);
+	}
+	mutex_unlock(&data->in_mutex);
+}
+
+/*
+ * A blocking write returns once its messages have been sent. A
+ * non-blocking write returns once they are queued; errors are reported
+ * by the next write and by poll.
+ */
+static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
+			    size_t count, loff_t *f_pos)
+{
+	struct usbtmc_file_data *file_data;
+	struct usbtmc_device_data *data;
+	ssize_t retval;
+	bool nonblock;
+
+	file_data = filp->private_data;
+	data = file_data->data;
+	nonblock = filp->f_flags & O_NONBLOCK;
+
+	if (nonblock) {
+		if (!mutex_trylock(&data->out_mutex))
+			return -EAGAIN;
+	} else {
+		mutex_lock(&data->out_mutex);
+	}
+
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	if (!nonblock && usbtmc_zero_copy_write(file_data, count)) {
+		retval = usbtmc_out_drain(data);
+		if (!retval)
+			retval = usbtmc_write_pinned(data, buf, count);
+		goto exit;
+	}
+
+	retval = usbtmc_write_message(file_data, buf, count, nonblock);
+
+	/* Wait for the messages still in flight, oldest first */
+	if (retval >= 0 && !nonblock) {
+		int rv = usbtmc_out_drain(data);
+
+		if (rv < 0)
+			retval = rv;
+	}
+exit:
+	mutex_unlock(&data->out_mutex);
+
+	if (file_data->prefetch_size && retval == count && data->eom_val &&
+	    usbtmc_is_query(buf, count))
+		usbtmc_prefetch(file_data, nonblock);
+
+	return retval;
+}
+
+/*
+ * Sends a command and reads the response in one call. The command is
+ * queued on the bulk out ring and the REQUEST_DEV_DEP_MSG_IN follows
+ * right behind it.
+ */
+static int usbtmc_ioctl_query(struct usbtmc_file_data *file_data,
+			      void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_query query;
+	ssize_t retval;
+
+	if (copy_from_user(&query, arg, sizeof(query)))
+		return -EFAULT;
+
+	if (!query.cmd_len || !query.resp_size)
+		return -EINVAL;
+
+	mutex_lock(&data->in_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	if (rcu_access_pointer(data->stream) || data->aio_read ||
+	    data->in_state != USBTMC_IN_IDLE) {
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	mutex_lock(&data->out_mutex);
+	retval = usbtmc_write_message(file_data,
+				      u64_to_user_ptr(query.cmd),
+				      query.cmd_len, false);
+	mutex_unlock(&data->out_mutex);
+	if (retval < 0)
+		goto exit;
+
+	retval = usbtmc_read_message(file_data,
+				     u64_to_user_ptr(query.resp), NULL,
+				     query.resp_size, NULL);
+	if (retval < 0)
+		goto exit;
+
+	query.resp_len = retval;
+	if (copy_to_user(arg, &query, sizeof(query)))
+		retval = -EFAULT;
+exit:
+	mutex_unlock(&data->in_mutex);
+	return retval;
+}
+
+/*
+ * Parses an IEEE 488.2 definite length block header "#<n><length>" at
+ * the start of the buffered response. On success the header is
+ * removed from the response and the payload length is returned in len.
+ * A response that does not start with a block header is left alone.
+ */
+static int usbtmc_parse_block_header(struct usbtmc_device_data *data,
+				     u64 *len)
+{
+	const u8 *p = data->in_data;
+	unsigned int digits;
+	unsigned int i;
+
+	if (data->in_len < 2 || p[0] != '#' || p[1] < '1' || p[1] > '9')
+		return -EBADMSG;
+
+	digits = p[1] - '0';
+	if (data->in_len < 2 + digits)
+		return -EBADMSG;
+
+	*len = 0;
+	for (i = 0; i < digits; i++) {
+		if (!isdigit(p[2 + i]))
+			return -EBADMSG;
+		*len = *len * 10 + p[2 + i] - '0';
+	}
+
+	data->in_data += 2 + digits;
+	data->in_len -= 2 + digits;
+	if (!data->in_len)
+		WRITE_ONCE(data->in_state, USBTMC_IN_IDLE);
+	return 0;
+}
+
+/*
+ * Reads the first transfer of a response, unless it was already
+ * prefetched, and strips its definite length block header. The payload
+ * length is returned to the application; the following reads return
+ * the payload without the header.
+ */
+static int usbtmc_ioctl_read_block(struct usbtmc_file_data *file_data,
+				   void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	u64 len;
+	int retval;
+
+	mutex_lock(&data->in_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	if (rcu_access_pointer(data->stream) || data->aio_read ||
+	    file_data->rbuf_len || usbtmc_in_foreign(file_data)) {
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	if (data->in_state == USBTMC_IN_IDLE) {
+		retval = usbtmc_in_start(file_data, data->bufsize, false);
+		if (retval < 0)
+			goto exit;
+	}
+
+	if (data->in_state == USBTMC_IN_QUEUED) {
+		retval = usbtmc_in_finish(data, false);
+		if (retval < 0)
+			goto exit;
+	}
+
+	retval = usbtmc_parse_block_header(data, &len);
+	if (retval < 0) {
+		dev_dbg(&data->intf->dev, "no block header in response\n");
+		goto exit;
+	}
+
+	if (put_user(len, (__u64 __user *)arg))
+		retval = -EFAULT;
+exit:
+	mutex_unlock(&data->in_mutex);
+	return retval;
+}
+
+/*
+ * Runs an array of commands and queries. Messages without a response
+ * are queued back to back on the bulk out ring; the ring is only
+ * drained when a response is read and at the end. A failed message is
+ * reported in the entry that was being processed when the failure was
+ * detected, the remaining entries get -ECANCELED.
+ */
+static int usbtmc_ioctl_batch(struct usbtmc_file_data *file_data,
+			      void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_batch_entry *entries;
+	struct usbtmc_batch_entry *entry;
+	struct usbtmc_batch batch;
+	ssize_t retval = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > USBTMC_BATCH_MAX_ENTRIES)
+		return -EINVAL;
+
+	entries = memdup_user(u64_to_user_ptr(batch.entries),
+			      batch.count * sizeof(*entries));
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	for (i = 0; i < batch.count; i++) {
+		entries[i].in_len = 0;
+		entries[i].status = -ECANCELED;
+	}
+
+	mutex_lock(&data->in_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto unlock;
+	}
+
+	if (rcu_access_pointer(data->stream) || data->aio_read ||
+	    data->in_state != USBTMC_IN_IDLE) {
+		retval = -EBUSY;
+		goto unlock;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		entry = &entries[i];
+
+		mutex_lock(&data->out_mutex);
+		retval = usbtmc_write_message(file_data,
+					      u64_to_user_ptr(entry->out),
+					      entry->out_len, false);
+		/* Make sure the last messages have been sent */
+		if (retval >= 0 && i == batch.count - 1 && !entry->in_size)
+			retval = usbtmc_out_drain(data);
+		mutex_unlock(&data->out_mutex);
+
+		if (retval >= 0 && entry->in_size) {
+			retval = usbtmc_read_message(file_data,
+					u64_to_user_ptr(entry->in), NULL,
+					entry->in_size, NULL);
+			if (retval >= 0)
+				entry->in_len = retval;
+		}
+
+		entry->status = retval < 0 ? retval : 0;
+		if (retval < 0)
+			break;
+	}
+	if (retval > 0)
+		retval = 0;
+
+unlock:
+	mutex_unlock(&data->in_mutex);
+
+	if (copy_to_user(u64_to_user_ptr(batch.entries), entries,
+			 batch.count * sizeof(*entries)))
+		retval = -EFAULT;
+	kfree(entries);
+	return retval;
+}
+
+static void usbtmc_aio_free(struct usbtmc_aio *aio)
+{
+	usb_free_urb(aio->urb);
+	usb_free_urb(aio->req_urb);
+	kfree(aio->buffer);
+	kfree(aio->req_buffer);
+	kfree(aio->iter_mem);
+	kfree(aio);
+}
+
+/*
+ * Allocates an asynchronous write with a buffer of size bytes, or a read
+ * when size is 0. A read only needs room for its request: the response
+ * is received into in_pool[0].
+ */
+static struct usbtmc_aio *usbtmc_aio_alloc(struct usbtmc_device_data *data,
+					   struct kiocb *iocb, size_t size)
+{
+	struct usbtmc_aio *aio;
+
+	aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+	if (!aio)
+		return NULL;
+
+	aio->iocb = iocb;
+	aio->data = data;
+	if (size) {
+		aio->urb = usb_alloc_urb(0, GFP_KERNEL);
+		aio->buffer = kmalloc(size, GFP_KERNEL);
+		if (!aio->urb || !aio->buffer)
+			goto error;
+	} else {
+		aio->req_urb = usb_alloc_urb(0, GFP_KERNEL);
+		aio->req_buffer = kmalloc(USBTMC_HEADER_SIZE, GFP_KERNEL);
+		if (!aio->req_urb || !aio->req_buffer)
+			goto error;
+	}
+	return aio;
+
+error:
+	usbtmc_aio_free(aio);
+	return NULL;
+}
+
+static void usbtmc_aio_read_work(struct work_struct *work)
+{
+	struct usbtmc_aio *aio = container_of(work, struct usbtmc_aio, work);
+	struct usbtmc_device_data *data = aio->data;
+	struct kiocb *iocb = aio->iocb;
+	u8 *buffer = aio->turb->buffer;
+	int actual = aio->turb->urb->actual_length;
+	u32 n_characters;
+	ssize_t retval;
+
+	del_timer_sync(&aio->timer);
+
+	retval = aio->req_status ? aio->req_status : aio->turb->urb->status;
+	if (retval < 0 && aio->timed_out)
+		retval = -ETIMEDOUT;
+	if (retval < 0) {
+		dev_dbg(&data->intf->dev, "async read failed: %zd\n", retval);
+		goto done;
+	}
+
+	if (actual < USBTMC_HEADER_SIZE || buffer[0] != 2 ||
+	    buffer[1] != aio->bTag) {
+		dev_err(&data->intf->dev, "Device sent bad header for bTag %u\n",
+			aio->bTag);
+		retval = -EPROTO;
+		goto done;
+	}
+
+	n_characters = buffer[4] +
+		       (buffer[5] << 8) +
+		       (buffer[6] << 16) +
+		       (buffer[7] << 24);
+
+	if (n_characters > aio->count ||
+	    n_characters > actual - USBTMC_HEADER_SIZE) {
+		dev_err(&data->intf->dev, "Device sent bad length: %u\n",
+			n_characters);
+		retval = -EPROTO;
+		goto done;
+	}
+
+	if (aio->mm) {
+		if (!mmget_not_zero(aio->mm)) {
+			retval = -EFAULT;
+			goto done;
+		}
+		use_mm(aio->mm);
+		retval = copy_to_iter(buffer + USBTMC_HEADER_SIZE,
+				      n_characters, &aio->to);
+		unuse_mm(aio->mm);
+		mmput(aio->mm);
+	} else {
+		retval = copy_to_iter(buffer + USBTMC_HEADER_SIZE,
+				      n_characters, &aio->to);
+	}
+	if (!retval && n_characters)
+		retval = -EFAULT;
+
+done:
+	if (aio->mm)
+		mmdrop(aio->mm);
+	usbtmc_aio_free(aio);
+
+	/* The iocb holds the last reference to the file and thus data */
+	WRITE_ONCE(data->aio_read, false);
+	wake_up_interruptible(&data->waitq);
+	iocb->ki_complete(iocb, retval, 0);
+}
+
+static void usbtmc_aio_read_put(struct usbtmc_aio *aio)
+{
+	if (atomic_dec_and_test(&aio->pending))
+		schedule_work(&aio->work);
+}
+
+static void usbtmc_aio_request_complete(struct urb *urb)
+{
+	struct usbtmc_aio *aio = urb->context;
+
+	/* Without the request the device never answers the read */
+	if (urb->status) {
+		aio->req_status = urb->status;
+		usb_unlink_urb(aio->turb->urb);
+	}
+	usbtmc_aio_read_put(aio);
+}
+
+static void usbtmc_aio_read_complete(struct urb *urb)
+{
+	struct usbtmc_aio *aio = urb->context;
+
+	usbtmc_stamp_complete(aio->data, urb);
+	/* A killed read does not wait for its request either */
+	if (urb->status)
+		usb_unlink_urb(aio->req_urb);
+	usbtmc_aio_read_put(aio);
+}
+
+static void usbtmc_aio_read_timeout(struct timer_list *t)
+{
+	struct usbtmc_aio *aio = from_timer(aio, t, timer);
+
+	aio->timed_out = true;
+	usb_unlink_urb(aio->turb->urb);
+}
+
+/*
+ * Locks mutex, or only tries to for IOCB_NOWAIT requests.
+ */
+static int usbtmc_aio_lock(struct kiocb *iocb, struct mutex *mutex)
+{
+	if (!(iocb->ki_flags & IOCB_NOWAIT)) {
+		mutex_lock(mutex);
+		return 0;
+	}
+	return mutex_trylock(mutex) ? 0 : -EAGAIN;
+}
+
+/*
+ * Starts an asynchronous read of one bulk in transfer, i.e. up to
+ * bufsize - USBTMC_HEADER_SIZE bytes of a message. Returns
+ * -EIOCBQUEUED once the URBs are submitted; the result is reported
+ * through ki_complete.
+ */
+static ssize_t usbtmc_aio_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct usbtmc_file_data *file_data = iocb->ki_filp->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_aio *aio;
+	size_t count;
+	ssize_t retval;
+
+	count = min_t(size_t, iov_iter_count(to),
+		      data->bufsize - USBTMC_HEADER_SIZE);
+	if (!count)
+		return 0;
+
+	aio = usbtmc_aio_alloc(data, iocb, 0);
+	if (!aio)
+		return -ENOMEM;
+
+	aio->count = count;
+	INIT_WORK(&aio->work, usbtmc_aio_read_work);
+	timer_setup(&aio->timer, usbtmc_aio_read_timeout, 0);
+	aio->iter_mem = dup_iter(&aio->to, to, GFP_KERNEL);
+	if (!aio->iter_mem) {
+		usbtmc_aio_free(aio);
+		return -ENOMEM;
+	}
 
-			/* Remove the USBTMC header */
-			actual -= USBTMC_HEADER_SIZE;
+	retval = usbtmc_aio_lock(iocb, &data->in_mutex);
+	if (retval) {
+		usbtmc_aio_free(aio);
+		return retval;
+	}
 
-			/* Check if the message is smaller than requested */
-			if (remaining > n_characters)
-				remaining = n_characters;
-			/* Remove padding if it exists */
-			if (actual > remaining)
-				actual = remaining;
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto error;
+	}
 
-			dev_dbg(dev, "Bulk-IN header: N_characters(%u), bTransAttr(%u)\n", n_characters, buffer[8]);
+	/* One read at a time owns the bulk in endpoint */
+	if (rcu_access_pointer(data->stream) || data->aio_read ||
+	    data->in_state != USBTMC_IN_IDLE) {
+		retval = -EBUSY;
+		goto error;
+	}
 
-			remaining -= actual;
+	retval = usbtmc_aio_lock(iocb, &data->out_mutex);
+	if (retval)
+		goto error;
 
-			/* Terminate if end-of-message bit received from device */
-			if ((buffer[8] & 0x01) && (actual >= n_characters))
-				remaining = 0;
+	usbtmc_setup_request_msg(file_data, aio->req_buffer, count);
+	aio->bTag = data->bTag;
+	atomic_set(&aio->pending, 2);
+	if (iter_is_iovec(to)) {
+		aio->mm = current->mm;
+		mmgrab(aio->mm);
+	}
+	data->aio_read = true;
+	aio->turb = &data->in_pool[0];
+
+	/*
+	 * Queue the bulk in URB first so that no data can be missed. It is
+	 * anchored with the synchronous reads, so that usbtmc_in_cancel()
+	 * kills it too.
+	 */
+	usb_fill_bulk_urb(aio->turb->urb, data->usb_dev,
+			  usb_rcvbulkpipe(data->usb_dev, data->bulk_in),
+			  aio->turb->buffer, data->bufsize,
+			  usbtmc_aio_read_complete, aio);
+	usb_anchor_urb(aio->turb->urb, &data->in_anchor);
+	retval = usb_submit_urb(aio->turb->urb, GFP_KERNEL);
+	if (retval < 0) {
+		usb_unanchor_urb(aio->turb->urb);
+		dev_err(&data->intf->dev, "%s: submit failed %zd\n",
+			__func__, retval);
+		data->aio_read = false;
+		if (aio->mm)
+			mmdrop(aio->mm);
+		mutex_unlock(&data->out_mutex);
+		goto error;
+	}
+	mod_timer(&aio->timer, jiffies + msecs_to_jiffies(data->timeout));
+
+	usb_fill_bulk_urb(aio->req_urb, data->usb_dev,
+			  usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+			  aio->req_buffer, USBTMC_HEADER_SIZE,
+			  usbtmc_aio_request_complete, aio);
+	usb_anchor_urb(aio->req_urb, &data->aio_anchor);
+	WRITE_ONCE(data->ts.read_start, ktime_get_ns());
+	retval = usb_submit_urb(aio->req_urb, GFP_KERNEL);
+	if (retval < 0) {
+		/* Reported through the bulk in URB's completion */
+		usb_unanchor_urb(aio->req_urb);
+		aio->req_status = retval;
+		usb_unlink_urb(aio->turb->urb);
+		usbtmc_aio_read_put(aio);
+	}
 
-			dev_dbg(dev, "Bulk-IN header: remaining(%zu), buf(%p), buffer(%p) done(%zu)\n", remaining,buf,buffer,done);
+	/* Store bTag (in case we need to abort) */
+	data->bTag_last_write = data->bTag;
+	data->bTag++;
+	if (!data->bTag)
+		data->bTag++;
+	mutex_unlock(&data->out_mutex);
 
+	data->bTag_last_read = aio->bTag;
+	mutex_unlock(&data->in_mutex);
+	return -EIOCBQUEUED;
 
-			/* Copy buffer to user space */
-			if (copy_to_user(buf + done, &buffer[USBTMC_HEADER_SIZE], actual)) {
-				/* There must have been an addressing problem */
-				retval = -EFAULT;
-				goto exit;
-			}
-			done += actual;
-		}
-		else  {
-			if (actual > remaining)
-				actual = remaining;
+error:
+	mutex_unlock(&data->in_mutex);
+	usbtmc_aio_free(aio);
+	return retval;
+}
 
-			remaining -= actual;
+static void usbtmc_aio_write_work(struct work_struct *work)
+{
+	struct usbtmc_aio *aio = container_of(work, struct usbtmc_aio, work);
+	struct kiocb *iocb = aio->iocb;
+	ssize_t retval = aio->count;
 
-			dev_dbg(dev, "Bulk-IN header cont: actual(%u), done(%zu), remaining(%zu), buf(%p), buffer(%p)\n", actual, done, remaining,buf,buffer);
+	del_timer_sync(&aio->timer);
 
-			/* Copy buffer to user space */
-			if (copy_to_user(buf + done, buffer, actual)) {
-				/* There must have been an addressing problem */
-				retval = -EFAULT;
-				goto exit;
-			}
-			done += actual;
-		}
+	if (aio->urb->status) {
+		retval = aio->timed_out ? -ETIMEDOUT : aio->urb->status;
+		dev_dbg(&aio->data->intf->dev, "async write failed: %zd\n",
+			retval);
 	}
 
-	/* Update file position value */
-	*f_pos = *f_pos + done;
-	retval = done;
+	usbtmc_aio_free(aio);
+	iocb->ki_complete(iocb, retval, 0);
+}
 
-exit:
-	mutex_unlock(&data->io_mutex);
-	kfree(buffer);
-	return retval;
+static void usbtmc_aio_write_complete(struct urb *urb)
+{
+	struct usbtmc_aio *aio = urb->context;
+
+	usbtmc_stamp_complete(aio->data, urb);
+	schedule_work(&aio->work);
 }
 
-static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
-			    size_t count, loff_t *f_pos)
+static void usbtmc_aio_write_timeout(struct timer_list *t)
 {
-	struct usbtmc_file_data *file_data;
-	struct usbtmc_device_data *data;
-	u8 *buffer;
-	int retval;
-	int actual;
+	struct usbtmc_aio *aio = from_timer(aio, t, timer);
+
+	aio->timed_out = true;
+	usb_unlink_urb(aio->urb);
+}
+
+/*
+ * Starts an asynchronous write of one DEV_DEP_MSG_OUT message holding
+ * up to bufsize - USBTMC_HEADER_SIZE bytes. The EOM bit is only set
+ * when the message holds all of the data.
+ */
+static ssize_t usbtmc_aio_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct usbtmc_file_data *file_data = iocb->ki_filp->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_aio *aio;
 	unsigned long int n_bytes;
-	int remaining;
-	int done;
-	int this_part;
+	size_t count;
+	ssize_t retval;
+	u8 *buffer;
 
-	file_data = filp->private_data;
-	data = file_data->data;
+	count = min_t(size_t, iov_iter_count(from),
+		      data->bufsize - USBTMC_HEADER_SIZE);
+	if (!count)
+		return 0;
 
-	buffer = kmalloc(io_buffer_size, GFP_KERNEL);
-	if (!buffer)
+	n_bytes = roundup(USBTMC_HEADER_SIZE + count, 4);
+	aio = usbtmc_aio_alloc(data, iocb, n_bytes);
+	if (!aio)
 		return -ENOMEM;
 
-	mutex_lock(&data->io_mutex);
+	aio->count = count;
+	INIT_WORK(&aio->work, usbtmc_aio_write_work);
+	timer_setup(&aio->timer, usbtmc_aio_write_timeout, 0);
+	buffer = aio->buffer;
+	buffer[8] = (count == iov_iter_count(from)) ? data->eom_val : 0;
+
+	if (!copy_from_iter_full(buffer + USBTMC_HEADER_SIZE, count, from)) {
+		usbtmc_aio_free(aio);
+		return -EFAULT;
+	}
+	memset(buffer + USBTMC_HEADER_SIZE + count, 0,
+	       n_bytes - (USBTMC_HEADER_SIZE + count));
+
+	retval = usbtmc_aio_lock(iocb, &data->out_mutex);
+	if (retval) {
+		usbtmc_aio_free(aio);
+		return retval;
+	}
+
 	if (data->zombie) {
 		retval = -ENODEV;
-		goto exit;
+		goto error;
 	}
 
-	remaining = count;
-	done = 0;
+	/* Setup IO buffer for DEV_DEP_MSG_OUT message */
+	buffer[0] = 1;
+	buffer[1] = data->bTag;
+	buffer[2] = ~data->bTag;
+	buffer[3] = 0; /* Reserved */
+	buffer[4] = count >> 0;
+	buffer[5] = count >> 8;
+	buffer[6] = count >> 16;
+	buffer[7] = count >> 24;
+	/* buffer[8] is set above... */
+	buffer[9] = 0; /* Reserved */
+	buffer[10] = 0; /* Reserved */
+	buffer[11] = 0; /* Reserved */
 
-	while (remaining > 0) {
-		if (remaining > io_buffer_size - USBTMC_HEADER_SIZE) {
-			this_part = io_buffer_size - USBTMC_HEADER_SIZE;
-			buffer[8] = 0;
-		} else {
-			this_part = remaining;
-			buffer[8] = data->eom_val;
-		}
+	usb_fill_bulk_urb(aio->urb, data->usb_dev,
+			  usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+			  buffer, n_bytes, usbtmc_aio_write_complete, aio);
+	usb_anchor_urb(aio->urb, &data->aio_anchor);
+	WRITE_ONCE(data->ts.write_start, ktime_get_ns());
+	/* Armed first: the work item may run as soon as the URB is queued */
+	mod_timer(&aio->timer, jiffies + msecs_to_jiffies(data->timeout));
+	retval = usb_submit_urb(aio->urb, GFP_KERNEL);
+	if (retval < 0) {
+		del_timer_sync(&aio->timer);
+		usb_unanchor_urb(aio->urb);
+		dev_err(&data->intf->dev, "%s: submit failed %zd\n",
+			__func__, retval);
+		goto error;
+	}
 
-		/* Setup IO buffer for DEV_DEP_MSG_OUT message */
-		buffer[0] = 1;
-		buffer[1] = data->bTag;
-		buffer[2] = ~data->bTag;
-		buffer[3] = 0; /* Reserved */
-		buffer[4] = this_part >> 0;
-		buffer[5] = this_part >> 8;
-		buffer[6] = this_part >> 16;
-		buffer[7] = this_part >> 24;
-		/* buffer[8] is set above... */
-		buffer[9] = 0; /* Reserved */
-		buffer[10] = 0; /* Reserved */
-		buffer[11] = 0; /* Reserved */
+	data->bTag_last_write = data->bTag;
+	data->bTag++;
+	if (!data->bTag)
+		data->bTag++;
 
-		if (copy_from_user(&buffer[USBTMC_HEADER_SIZE], buf + done, this_part)) {
-			retval = -EFAULT;
-			goto exit;
-		}
+	mutex_unlock(&data->out_mutex);
+	return -EIOCBQUEUED;
 
-		n_bytes = roundup(USBTMC_HEADER_SIZE + this_part, 4);
-		memset(buffer + USBTMC_HEADER_SIZE + this_part, 0, n_bytes - (USBTMC_HEADER_SIZE + this_part));
+error:
+	mutex_unlock(&data->out_mutex);
+	usbtmc_aio_free(aio);
+	return retval;
+}
 
-		do {
-			retval = usb_bulk_msg(data->usb_dev,
-					      usb_sndbulkpipe(data->usb_dev,
-							      data->bulk_out),
-					      buffer, n_bytes,
-					      &actual, data->timeout);
-			if (retval != 0)
-				break;
-			n_bytes -= actual;
-		} while (n_bytes);
-
-		data->bTag_last_write = data->bTag;
-		data->bTag++;
+/*
+ * Synchronous callers (readv, preadv2) are served by usbtmc_read with
+ * the first segment of the iterator; asynchronous ones (io_submit,
+ * io_uring) by usbtmc_aio_read.
+ */
+static ssize_t usbtmc_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t retval;
 
-		if (!data->bTag)
-			data->bTag++;
+	if (!is_sync_kiocb(iocb))
+		return usbtmc_aio_read(iocb, to);
 
-		if (retval < 0) {
-			dev_err(&data->intf->dev,
-				"Unable to send data, error %d\n", retval);
-			if (data->auto_abort)
-				usbtmc_ioctl_abort_bulk_out(data);
-			goto exit;
-		}
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+	if (!iter_is_iovec(to))
+		return -EINVAL;
 
-		remaining -= this_part;
-		done += this_part;
-	}
+	retval = usbtmc_read(iocb->ki_filp,
+			     to->iov->iov_base + to->iov_offset,
+			     iov_iter_single_seg_count(to), &iocb->ki_pos);
+	if (retval > 0)
+		iov_iter_advance(to, retval);
+	return retval;
+}
 
-	retval = count;
-exit:
-	mutex_unlock(&data->io_mutex);
-	kfree(buffer);
+static ssize_t usbtmc_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t retval;
+
+	if (!is_sync_kiocb(iocb))
+		return usbtmc_aio_write(iocb, from);
+
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+	if (!iter_is_iovec(from))
+		return -EINVAL;
+
+	retval = usbtmc_write(iocb->ki_filp,
+			      from->iov->iov_base + from->iov_offset,
+			      iov_iter_single_seg_count(from), &iocb->ki_pos);
+	if (retval > 0)
+		iov_iter_advance(from, retval);
 	return retval;
 }
 
 static int usbtmc_ioctl_clear(struct usbtmc_device_data *data)
 {
-	struct usb_host_interface *current_setting;
-	struct usb_endpoint_descriptor *desc;
+	unsigned long deadline = jiffies + msecs_to_jiffies(data->timeout);
+	unsigned int delay = USBTMC_STATUS_POLL_MIN_MS;
 	struct device *dev;
 	u8 *buffer;
 	int rv;
-	int n;
-	int actual = 0;
-	int max_size;
 
 	dev = &data->intf->dev;
 
+	/* Pending asynchronous reads and writes are discarded */
+	usb_kill_anchored_urbs(&data->aio_anchor);
+	usbtmc_rbuf_drop(data);
+
 	dev_dbg(dev, "Sending INITIATE_CLEAR request\n");
 
-	buffer = kmalloc(io_buffer_size, GFP_KERNEL);
+	buffer = kmalloc(8, GFP_KERNEL);
 	if (!buffer)
 		return -ENOMEM;
 
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_INITIATE_CLEAR,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
-			     0, 0, buffer, 1, data->timeout);
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
+	rv = usbtmc_ctrl_in(data, USBTMC_REQUEST_INITIATE_CLEAR,
+			    USB_RECIP_INTERFACE, 0, 0, buffer, 1, deadline);
+	if (rv < 0)
 		goto exit;
-	}
 
 	dev_dbg(dev, "INITIATE_CLEAR returned %x\n", buffer[0]);
 
@@ -995,79 +3466,36 @@ static int usbtmc_ioctl_clear(struct usbtmc_device_data *data)
 		goto exit;
 	}
 
-	max_size = 0;
-	current_setting = data->intf->cur_altsetting;
-	for (n = 0; n < current_setting->desc.bNumEndpoints; n++) {
-		desc = &current_setting->endpoint[n].desc;
-		if (desc->bEndpointAddress == data->bulk_in)
-			max_size = usb_endpoint_maxp(desc);
-	}
-
-	if (max_size == 0) {
-		dev_err(dev, "Couldn't get wMaxPacketSize\n");
-		rv = -EPERM;
-		goto exit;
-	}
-
-	dev_dbg(dev, "wMaxPacketSize is %d\n", max_size);
-
-	n = 0;
-
-usbtmc_clear_check_status:
-
-	dev_dbg(dev, "Sending CHECK_CLEAR_STATUS request\n");
-
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_CHECK_CLEAR_STATUS,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
-			     0, 0, buffer, 2, data->timeout);
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
-	}
-
-	dev_dbg(dev, "CHECK_CLEAR_STATUS returned %x\n", buffer[0]);
+	for (;;) {
+		dev_dbg(dev, "Sending CHECK_CLEAR_STATUS request\n");
 
-	if (buffer[0] == USBTMC_STATUS_SUCCESS)
-		goto usbtmc_clear_bulk_out_halt;
-
-	if (buffer[0] != USBTMC_STATUS_PENDING) {
-		dev_err(dev, "CHECK_CLEAR_STATUS returned %x\n", buffer[0]);
-		rv = -EPERM;
-		goto exit;
-	}
+		rv = usbtmc_ctrl_in(data, USBTMC_REQUEST_CHECK_CLEAR_STATUS,
+				    USB_RECIP_INTERFACE, 0, 0, buffer, 2,
+				    deadline);
+		if (rv < 0)
+			goto exit;
 
-	if (buffer[1] == 1)
-		do {
-			dev_dbg(dev, "Reading from bulk in EP\n");
+		dev_dbg(dev, "CHECK_CLEAR_STATUS returned %x\n", buffer[0]);
 
-			rv = usb_bulk_msg(data->usb_dev,
-					  usb_rcvbulkpipe(data->usb_dev,
-							  data->bulk_in),
-					  buffer, io_buffer_size,
-					  &actual, data->timeout);
-			n++;
+		if (buffer[0] == USBTMC_STATUS_SUCCESS)
+			break;
 
-			if (rv < 0) {
-				dev_err(dev, "usb_control_msg returned %d\n",
-					rv);
-				goto exit;
-			}
-		} while ((actual == max_size) &&
-			  (n < USBTMC_MAX_READS_TO_CLEAR_BULK_IN));
+		if (buffer[0] != USBTMC_STATUS_PENDING) {
+			dev_err(dev, "CHECK_CLEAR_STATUS returned %x\n",
+				buffer[0]);
+			rv = -EPERM;
+			goto exit;
+		}
 
-	if (actual == max_size) {
-		dev_err(dev, "Couldn't clear device buffer within %d cycles\n",
-			USBTMC_MAX_READS_TO_CLEAR_BULK_IN);
-		rv = -EPERM;
-		goto exit;
+		/* bmClear.D0 set: the device still has data queued */
+		if (buffer[1] == 1)
+			rv = usbtmc_drain_bulk_in(data, deadline);
+		else
+			rv = usbtmc_status_backoff(&delay, deadline);
+		if (rv < 0)
+			goto exit;
 	}
 
-	goto usbtmc_clear_check_status;
-
-usbtmc_clear_bulk_out_halt:
-
 	rv = usb_clear_halt(data->usb_dev,
 			    usb_sndbulkpipe(data->usb_dev, data->bulk_out));
 	if (rv < 0) {
@@ -1100,6 +3528,8 @@ static int usbtmc_ioctl_clear_in_halt(struct usbtmc_device_data *data)
 {
 	int rv;
 
+	usbtmc_rbuf_drop(data);
+
 	rv = usb_clear_halt(data->usb_dev,
 			    usb_rcvbulkpipe(data->usb_dev, data->bulk_in));
 
@@ -1320,25 +3750,194 @@ static int usbtmc_ioctl_request(struct usbtmc_device_data *data, void __user *ar
 			request.req.wIndex,
 			buffer, request.req.wLength, data->timeout);
 
-	if (rv < 0) {
-		dev_err(dev, "generic usb_control_msg failed %d\n", rv);
-		goto exit;
+	if (rv < 0) {
+		dev_err(dev, "generic usb_control_msg failed %d\n", rv);
+		goto exit;
+	}
+	if ((request.req.bRequestType & USB_DIR_IN)) {
+		if (rv > request.req.wLength ) {
+			dev_warn(dev, "generic usb_control_msg returned too much data: %d\n", rv);
+			rv = request.req.wLength;
+		}
+
+		res = copy_to_user(request.data, buffer, rv );
+		if (res) {
+			rv = -EFAULT;
+		}
+	}
+
+ exit:
+	kfree(buffer);
+	return rv;
+}
+
+static void usbtmc_ctrl_complete(struct urb *urb)
+{
+	struct usbtmc_ctrl *ctrl = urb->context;
+	struct usbtmc_file_data *file_data = ctrl->file_data;
+
+	/*
+	 * Set the flag before completing: once the request is complete
+	 * USBTMC_IOCTL_CTRL_RESULT may clear the flag and free ctrl.
+	 */
+	WRITE_ONCE(file_data->ctrl_done, true);
+	complete(&ctrl->done);
+	/* poll reports POLLRDBAND now */
+	wake_up_interruptible(&file_data->data->waitq);
+}
+
+/*
+ * Submits a control request on the default pipe without waiting for
+ * it. The result is collected with USBTMC_IOCTL_CTRL_RESULT.
+ */
+static int usbtmc_ioctl_ctrl_submit(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_async_ctrl req;
+	struct usbtmc_ctrl *ctrl;
+	unsigned int pipe;
+	bool in;
+	int retval;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	in = req.req.bRequestType & USB_DIR_IN;
+
+	ctrl = kzalloc(sizeof(*ctrl), GFP_KERNEL);
+	if (!ctrl)
+		return -ENOMEM;
+
+	ctrl->file_data = file_data;
+	ctrl->ubuf = u64_to_user_ptr(req.data);
+	init_completion(&ctrl->done);
+	ctrl->urb = usb_alloc_urb(0, GFP_KERNEL);
+	ctrl->setup = kmalloc(sizeof(*ctrl->setup), GFP_KERNEL);
+	ctrl->buffer = kmalloc(max_t(u16, req.req.wLength, 1), GFP_KERNEL);
+	if (!ctrl->urb || !ctrl->setup || !ctrl->buffer) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	if (!in && copy_from_user(ctrl->buffer, ctrl->ubuf,
+				  req.req.wLength)) {
+		retval = -EFAULT;
+		goto error;
+	}
+
+	ctrl->setup->bRequestType = req.req.bRequestType;
+	ctrl->setup->bRequest = req.req.bRequest;
+	ctrl->setup->wValue = cpu_to_le16(req.req.wValue);
+	ctrl->setup->wIndex = cpu_to_le16(req.req.wIndex);
+	ctrl->setup->wLength = cpu_to_le16(req.req.wLength);
+
+	pipe = in ? usb_rcvctrlpipe(data->usb_dev, 0) :
+		    usb_sndctrlpipe(data->usb_dev, 0);
+	usb_fill_control_urb(ctrl->urb, data->usb_dev, pipe,
+			     (unsigned char *)ctrl->setup, ctrl->buffer,
+			     req.req.wLength, usbtmc_ctrl_complete, ctrl);
+
+	mutex_lock(&file_data->ctrl_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto unlock;
+	}
+
+	/* The previous result has to be collected first */
+	if (file_data->ctrl) {
+		retval = -EBUSY;
+		goto unlock;
+	}
+
+	WRITE_ONCE(file_data->ctrl_done, false);
+	usb_anchor_urb(ctrl->urb, &data->ctrl_anchor);
+	retval = usb_submit_urb(ctrl->urb, GFP_KERNEL);
+	if (retval) {
+		usb_unanchor_urb(ctrl->urb);
+		dev_err(&data->intf->dev, "usb_submit_urb returned %d\n",
+			retval);
+		goto unlock;
+	}
+
+	file_data->ctrl = ctrl;
+	mutex_unlock(&file_data->ctrl_mutex);
+	return 0;
+
+unlock:
+	mutex_unlock(&file_data->ctrl_mutex);
+error:
+	usbtmc_ctrl_free(ctrl);
+	return retval;
+}
+
+/*
+ * Collects the result of the request submitted by the file. Unless
+ * nonblock is set this waits up to the usb timeout for it; a request
+ * that times out is cancelled. status receives the number of bytes
+ * transferred or the error of the request.
+ */
+static int usbtmc_ioctl_ctrl_result(struct usbtmc_file_data *file_data,
+				    void __user *arg, bool nonblock)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_async_ctrl req;
+	struct usbtmc_ctrl *ctrl;
+	long rv;
+	int retval = 0;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	mutex_lock(&file_data->ctrl_mutex);
+	ctrl = file_data->ctrl;
+	if (!ctrl) {
+		retval = -EINVAL;
+		goto unlock;
 	}
-	if ((request.req.bRequestType & USB_DIR_IN)) {
-		if (rv > request.req.wLength ) {
-			dev_warn(dev, "generic usb_control_msg returned too much data: %d\n", rv);
-			rv = request.req.wLength;
-		}
 
-		res = copy_to_user(request.data, buffer, rv );
-		if (res) {
-			rv = -EFAULT;
+	if (!completion_done(&ctrl->done)) {
+		if (nonblock) {
+			retval = -EAGAIN;
+			goto unlock;
+		}
+		rv = wait_for_completion_interruptible_timeout(&ctrl->done,
+				msecs_to_jiffies(data->timeout));
+		if (rv < 0) {
+			retval = rv;
+			goto unlock;
+		}
+		if (rv == 0) {
+			usb_kill_urb(ctrl->urb);
+			ctrl->urb->status = -ETIMEDOUT;
 		}
 	}
 
- exit:
-	kfree(buffer);
-	return rv;
+	req.req.bRequestType = ctrl->setup->bRequestType;
+	req.req.bRequest = ctrl->setup->bRequest;
+	req.req.wValue = le16_to_cpu(ctrl->setup->wValue);
+	req.req.wIndex = le16_to_cpu(ctrl->setup->wIndex);
+	req.req.wLength = le16_to_cpu(ctrl->setup->wLength);
+	req.data = (uintptr_t)ctrl->ubuf;
+	req.status = ctrl->urb->status;
+	if (!req.status)
+		req.status = ctrl->urb->actual_length;
+	else
+		dev_dbg(&data->intf->dev, "async control request failed %d\n",
+			req.status);
+
+	if (req.status > 0 && (req.req.bRequestType & USB_DIR_IN) &&
+	    copy_to_user(ctrl->ubuf, ctrl->buffer, req.status))
+		retval = -EFAULT;
+	if (copy_to_user(arg, &req, sizeof(req)))
+		retval = -EFAULT;
+
+	file_data->ctrl = NULL;
+	WRITE_ONCE(file_data->ctrl_done, false);
+	usbtmc_ctrl_free(ctrl);
+unlock:
+	mutex_unlock(&file_data->ctrl_mutex);
+	return retval;
 }
 
 /*
@@ -1395,6 +3994,82 @@ static int usbtmc_ioctl_eom_enable(struct usbtmc_device_data *data,
 	return 0;
 }
 
+/*
+ * Sets the minimum read size for zero copy reads, 0 disables them
+ */
+static int usbtmc_ioctl_zc_read_threshold(struct usbtmc_file_data *file_data,
+					  void __user *arg)
+{
+	u32 threshold;
+
+	if (copy_from_user(&threshold, arg, sizeof(threshold)))
+		return -EFAULT;
+
+	file_data->zc_read_threshold = threshold;
+
+	return 0;
+}
+
+/*
+ * Sets the minimum write size for zero copy writes, 0 disables them
+ */
+static int usbtmc_ioctl_zc_write_threshold(struct usbtmc_file_data *file_data,
+					   void __user *arg)
+{
+	u32 threshold;
+
+	if (copy_from_user(&threshold, arg, sizeof(threshold)))
+		return -EFAULT;
+
+	file_data->zc_write_threshold = threshold;
+
+	return 0;
+}
+
+/*
+ * Sets the size of the buffer for buffered reads. Leftover bytes of
+ * the previous buffer are dropped. Called with in_mutex held.
+ */
+static int usbtmc_ioctl_read_buffer(struct usbtmc_file_data *file_data,
+				    void __user *arg)
+{
+	u32 size;
+	u8 *rbuf = NULL;
+
+	if (copy_from_user(&size, arg, sizeof(size)))
+		return -EFAULT;
+
+	if (size > USBTMC_MAX_READ_BUFFER)
+		return -EINVAL;
+
+	if (size) {
+		rbuf = kvmalloc(size, GFP_KERNEL);
+		if (!rbuf)
+			return -ENOMEM;
+	}
+
+	kvfree(file_data->rbuf);
+	file_data->rbuf = rbuf;
+	file_data->rbuf_size = size;
+	file_data->rbuf_off = 0;
+	file_data->rbuf_len = 0;
+
+	return 0;
+}
+
+static int usbtmc_ioctl_prefetch(struct usbtmc_file_data *file_data,
+				 void __user *arg)
+{
+	u32 size;
+
+	if (copy_from_user(&size, arg, sizeof(size)))
+		return -EFAULT;
+
+	file_data->prefetch_size = size;
+
+	return 0;
+}
+
 /*
  * Configure TermChar and TermCharEnable
  */
@@ -1417,41 +4092,304 @@ static int usbtmc_ioctl_config_termc(struct usbtmc_device_data *data,
 	return 0;
 }
 
-static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+/*
+ * Replaces the trigger group of the file with the devices of the given
+ * usbtmc file descriptors. Each device may only appear once.
+ */
+static int usbtmc488_ioctl_set_trigger_group(struct usbtmc_file_data *file_data,
+					     void __user *arg)
+{
+	struct usbtmc_device_data **group = NULL;
+	struct usbtmc_file_data *member;
+	struct usbtmc_trigger_group req;
+	__s32 __user *fds;
+	struct fd f;
+	__s32 fd;
+	u32 i, j;
+	int retval;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.count > USBTMC_TRIGGER_GROUP_MAX)
+		return -EINVAL;
+
+	if (req.count) {
+		group = kcalloc(req.count, sizeof(*group), GFP_KERNEL);
+		if (!group)
+			return -ENOMEM;
+	}
+
+	fds = u64_to_user_ptr(req.fds);
+	for (i = 0; i < req.count; i++) {
+		if (get_user(fd, fds + i)) {
+			retval = -EFAULT;
+			goto error;
+		}
+
+		f = fdget(fd);
+		if (!f.file) {
+			retval = -EBADF;
+			goto error;
+		}
+		if (f.file->f_op != &fops) {
+			fdput(f);
+			retval = -EINVAL;
+			goto error;
+		}
+		member = f.file->private_data;
+		group[i] = member->data;
+		kref_get(&group[i]->kref);
+		fdput(f);
+
+		/* A device is locked once per trigger */
+		for (j = 0; j < i; j++) {
+			if (group[j] == group[i]) {
+				retval = -EINVAL;
+				goto error;
+			}
+		}
+	}
+
+	mutex_lock(&usbtmc_trigger_mutex);
+	swap(group, file_data->trig_group);
+	swap(req.count, file_data->trig_count);
+	mutex_unlock(&usbtmc_trigger_mutex);
+
+	/* Drop the previous group */
+	usbtmc_trigger_group_free(group, req.count);
+	return 0;
+
+error:
+	usbtmc_trigger_group_free(group, req.count);
+	return retval;
+}
+
+/*
+ * Sends a TRIGGER message to every device of the trigger group. The
+ * messages are prepared first and then submitted back to back to keep
+ * the skew between the devices small. The submit and completion time
+ * and the status of each device are returned in the user array.
+ */
+static int usbtmc488_ioctl_group_trigger(struct usbtmc_file_data *file_data,
+					 void __user *arg)
+{
+	struct usbtmc_device_data **group;
+	struct usbtmc_trigger_time *times;
+	struct usbtmc_group_trigger req;
+	struct usbtmc_urb *turb;
+	u32 count;
+	u32 i;
+	int retval = 0;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	mutex_lock(&usbtmc_trigger_mutex);
+	group = file_data->trig_group;
+	count = file_data->trig_count;
+	if (!count || req.count < count) {
+		retval = -EINVAL;
+		goto unlock;
+	}
+
+	times = kcalloc(count, sizeof(*times), GFP_KERNEL);
+	if (!times) {
+		retval = -ENOMEM;
+		goto unlock;
+	}
+
+	/*
+	 * Hold every out_mutex so that no trigger lands between the
+	 * messages of a write. usbtmc_trigger_mutex orders the callers
+	 * that take more than one of them.
+	 */
+	for (i = 0; i < count; i++) {
+		mutex_lock_nest_lock(&group[i]->out_mutex,
+				     &usbtmc_trigger_mutex);
+		if (group[i]->zombie)
+			times[i].status = -ENODEV;
+		else
+			usbtmc_trigger_prepare(group[i]);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (times[i].status)
+			continue;
+		turb = group[i]->trig_urb;
+		times[i].submit = ktime_get_ns();
+		times[i].status = usb_submit_urb(turb->urb, GFP_KERNEL);
+		if (times[i].status)
+			usb_unanchor_urb(turb->urb);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (times[i].status)
+			continue;
+		turb = group[i]->trig_urb;
+		times[i].status = usbtmc_wait_urb(group[i], turb);
+		if (times[i].status < 0)
+			usb_kill_urb(turb->urb);
+		else
+			times[i].complete = turb->done_ns;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (times[i].status)
+			dev_err(&group[i]->intf->dev,
+				"group trigger returned %d\n",
+				times[i].status);
+		mutex_unlock(&group[i]->out_mutex);
+	}
+
+	if (copy_to_user(u64_to_user_ptr(req.times), times,
+			 count * sizeof(*times)))
+		retval = -EFAULT;
+
+	kfree(times);
+unlock:
+	mutex_unlock(&usbtmc_trigger_mutex);
+	return retval;
+}
+
+/*
+ * ioctls that use the bulk out endpoint. They run under out_mutex only,
+ * so they do not wait for a read in progress.
+ */
+static int usbtmc_ioctl_bulk_out(struct usbtmc_device_data *data,
+				 unsigned int cmd)
 {
-	struct usbtmc_file_data *file_data = file->private_data;
-	struct usbtmc_device_data *data = file_data->data;
 	int retval = -EBADRQC;
 
-	mutex_lock(&data->io_mutex);
+	mutex_lock(&data->out_mutex);
 	if (data->zombie) {
 		retval = -ENODEV;
-		goto skip_io_on_zombie;
+		goto exit;
 	}
 
+	/* Messages queued by non-blocking writes are dropped */
+	if (cmd != USBTMC488_IOCTL_TRIGGER)
+		usbtmc_out_cancel(data);
+
 	switch (cmd) {
 	case USBTMC_IOCTL_CLEAR_OUT_HALT:
 		retval = usbtmc_ioctl_clear_out_halt(data);
 		break;
 
+	case USBTMC_IOCTL_ABORT_BULK_OUT:
+		retval = usbtmc_ioctl_abort_bulk_out(data);
+		break;
+
+	case USBTMC488_IOCTL_TRIGGER:
+		retval = usbtmc488_ioctl_trigger(data);
+		break;
+	}
+exit:
+	mutex_unlock(&data->out_mutex);
+	return retval;
+}
+
+/*
+ * ioctls that use the bulk in endpoint. They run under in_mutex only.
+ */
+static int usbtmc_ioctl_bulk_in(struct usbtmc_device_data *data,
+				unsigned int cmd)
+{
+	int retval = -EBADRQC;
+
+	mutex_lock(&data->in_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	/* A response to a non-blocking read is dropped */
+	usbtmc_in_cancel(data);
+
+	switch (cmd) {
 	case USBTMC_IOCTL_CLEAR_IN_HALT:
 		retval = usbtmc_ioctl_clear_in_halt(data);
 		break;
 
-	case USBTMC_IOCTL_INDICATOR_PULSE:
-		retval = usbtmc_ioctl_indicator_pulse(data);
+	case USBTMC_IOCTL_ABORT_BULK_IN:
+		retval = usbtmc_ioctl_abort_bulk_in(data);
 		break;
+	}
+exit:
+	mutex_unlock(&data->in_mutex);
+	return retval;
+}
 
-	case USBTMC_IOCTL_CLEAR:
-		retval = usbtmc_ioctl_clear(data);
-		break;
+static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct usbtmc_file_data *file_data = file->private_data;
+	struct usbtmc_device_data *data = file_data->data;
+	int retval = -EBADRQC;
 
+	/* Bulk endpoint ioctls only lock the endpoint they use */
+	switch (cmd) {
+	case USBTMC_IOCTL_STREAM_STOP:
+		return usbtmc_stream_stop(file_data);
+
+	case USBTMC_IOCTL_QUERY:
+		return usbtmc_ioctl_query(file_data, (void __user *)arg);
+
+	case USBTMC_IOCTL_BATCH:
+		return usbtmc_ioctl_batch(file_data, (void __user *)arg);
+
+	case USBTMC_IOCTL_READ_BLOCK:
+		return usbtmc_ioctl_read_block(file_data, (void __user *)arg);
+
+	case USBTMC488_IOCTL_WAIT_SRQ:
+		return usbtmc488_ioctl_wait_srq(file_data, (void __user *)arg);
+
+	case USBTMC_IOCTL_GET_TIMESTAMPS:
+		return usbtmc_ioctl_get_timestamps(data, (void __user *)arg);
+
+	case USBTMC_IOCTL_CTRL_SUBMIT:
+		return usbtmc_ioctl_ctrl_submit(file_data, (void __user *)arg);
+
+	case USBTMC_IOCTL_CTRL_RESULT:
+		return usbtmc_ioctl_ctrl_result(file_data, (void __user *)arg,
+						file->f_flags & O_NONBLOCK);
+
+	case USBTMC488_IOCTL_SET_TRIGGER_GROUP:
+		return usbtmc488_ioctl_set_trigger_group(file_data,
+							 (void __user *)arg);
+
+	case USBTMC488_IOCTL_GROUP_TRIGGER:
+		return usbtmc488_ioctl_group_trigger(file_data,
+						     (void __user *)arg);
+
+	case USBTMC_IOCTL_CLEAR_OUT_HALT:
 	case USBTMC_IOCTL_ABORT_BULK_OUT:
-		retval = usbtmc_ioctl_abort_bulk_out(data);
-		break;
+	case USBTMC488_IOCTL_TRIGGER:
+		return usbtmc_ioctl_bulk_out(data, cmd);
 
+	case USBTMC_IOCTL_CLEAR_IN_HALT:
 	case USBTMC_IOCTL_ABORT_BULK_IN:
-		retval = usbtmc_ioctl_abort_bulk_in(data);
+		return usbtmc_ioctl_bulk_in(data, cmd);
+	}
+
+	mutex_lock(&data->io_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto skip_io_on_zombie;
+	}
+
+	switch (cmd) {
+	case USBTMC_IOCTL_INDICATOR_PULSE:
+		retval = usbtmc_ioctl_indicator_pulse(data);
+		break;
+
+	case USBTMC_IOCTL_CLEAR:
+		mutex_lock(&data->in_mutex);
+		mutex_lock(&data->out_mutex);
+		usbtmc_in_cancel(data);
+		usbtmc_out_cancel(data);
+		retval = usbtmc_ioctl_clear(data);
+		mutex_unlock(&data->out_mutex);
+		mutex_unlock(&data->in_mutex);
 		break;
 
 	case USBTMC_IOCTL_CTRL_REQUEST:
@@ -1474,6 +4412,34 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		retval = usbtmc_ioctl_config_termc(data, (void __user *)arg);
 		break;
 
+	case USBTMC_IOCTL_ZC_READ_THRESHOLD:
+		retval = usbtmc_ioctl_zc_read_threshold(file_data,
+							(void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_ZC_WRITE_THRESHOLD:
+		retval = usbtmc_ioctl_zc_write_threshold(file_data,
+							 (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_PREFETCH:
+		retval = usbtmc_ioctl_prefetch(file_data, (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_READ_BUFFER:
+		mutex_lock(&data->in_mutex);
+		retval = usbtmc_ioctl_read_buffer(file_data,
+						  (void __user *)arg);
+		mutex_unlock(&data->in_mutex);
+		break;
+
+	case USBTMC_IOCTL_STREAM_START:
+		mutex_lock(&data->in_mutex);
+		retval = usbtmc_ioctl_stream_start(file_data,
+						   (void __user *)arg);
+		mutex_unlock(&data->in_mutex);
+		break;
+
 	case USBTMC488_IOCTL_GET_CAPS:
 		retval = copy_to_user((void __user *)arg,
 				&data->usb488_caps,
@@ -1487,6 +4453,16 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 						  (void __user *)arg);
 		break;
 
+	case USBTMC488_IOCTL_READ_SRQ:
+		retval = usbtmc488_ioctl_read_srq(file_data,
+						  (void __user *)arg);
+		break;
+
+	case USBTMC488_IOCTL_SRQ_EVENTFD:
+		retval = usbtmc488_ioctl_srq_eventfd(file_data,
+						     (void __user *)arg);
+		break;
+
 	case USBTMC488_IOCTL_REN_CONTROL:
 		retval = usbtmc488_ioctl_simple(data, (void __user *)arg,
 						USBTMC488_REQUEST_REN_CONTROL);
@@ -1501,10 +4477,6 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		retval = usbtmc488_ioctl_simple(data, (void __user *)arg,
 						USBTMC488_REQUEST_LOCAL_LOCKOUT);
 		break;
-
-	case USBTMC488_IOCTL_TRIGGER:
-		retval = usbtmc488_ioctl_trigger(data);
-		break;
 	}
 
 skip_io_on_zombie:
@@ -1519,25 +4491,81 @@ static int usbtmc_fasync(int fd, struct file *file, int on)
 	return fasync_helper(fd, file, on, &file_data->data->fasync);
 }
 
+/*
+ * Readiness of the bulk endpoints for non-blocking reads and writes.
+ * Reads the ring and read state without locks; a stale value only
+ * makes poll report a state that the next read or write corrects.
+ */
+static __poll_t usbtmc_poll_bulk(struct usbtmc_file_data *file_data)
+{
+	struct usbtmc_device_data *data = file_data->data;
+	unsigned int n = data->out_pool_size;
+	unsigned int in_flight = READ_ONCE(data->out_in_flight);
+	struct usbtmc_urb *turb;
+	__poll_t mask = 0;
+
+	switch (READ_ONCE(data->in_owner) == file_data ?
+		READ_ONCE(data->in_state) : USBTMC_IN_IDLE) {
+	case USBTMC_IN_QUEUED:
+		if (completion_done(&data->in_pool[0].done))
+			mask |= POLLIN | POLLRDNORM;
+		break;
+	case USBTMC_IN_BUFFERED:
+		mask |= POLLIN | POLLRDNORM;
+		break;
+	}
+
+	if (in_flight < n)
+		mask |= POLLOUT | POLLWRNORM;
+
+	/* The oldest message in flight may have failed */
+	if (in_flight > 0) {
+		turb = &data->out_pool[(READ_ONCE(data->out_head) + n -
+					in_flight) % n];
+		if (completion_done(&turb->done)) {
+			mask |= POLLOUT | POLLWRNORM;
+			if (turb->urb->status)
+				mask |= POLLERR;
+		}
+	}
+	return mask;
+}
+
 static __poll_t usbtmc_poll(struct file *file, poll_table *wait)
 {
 	struct usbtmc_file_data *file_data = file->private_data;
 	struct usbtmc_device_data *data = file_data->data;
+	struct usbtmc_stream *stream;
 	__poll_t mask;
 
-	mutex_lock(&data->io_mutex);
+	/*
+	 * Never sleeps: all state is read with atomics or under RCU, so
+	 * poll does not wait for I/O in progress.
+	 */
+	poll_wait(file, &data->waitq, wait);
 
-	if (data->zombie) {
-		mask = POLLHUP | POLLERR;
-		goto no_poll;
-	}
+	if (READ_ONCE(data->zombie))
+		return POLLHUP | POLLERR;
 
-	poll_wait(file, &data->waitq, wait);
+	mask = kfifo_is_empty(&file_data->srq_queue) ? 0 : POLLPRI;
 
-	mask = (atomic_read(&file_data->srq_asserted)) ? POLLPRI : 0;
+	mask |= usbtmc_poll_bulk(file_data);
+
+	if (READ_ONCE(file_data->ctrl_done))
+		mask |= POLLRDBAND;
+
+	rcu_read_lock();
+	stream = rcu_dereference(data->stream);
+	if (stream && stream->file_data == file_data) {
+		if (READ_ONCE(stream->head) != READ_ONCE(stream->ctrl->tail))
+			mask |= POLLIN | POLLRDNORM;
+		/* The tail may have moved while the ring was full */
+		wake_up_interruptible(&stream->space_waitq);
+		if (READ_ONCE(stream->ctrl->flags) & USBTMC_STREAM_STOPPED)
+			mask |= POLLERR;
+	}
+	rcu_read_unlock();
 
-no_poll:
-	mutex_unlock(&data->io_mutex);
 	return mask;
 }
 
@@ -1545,6 +4573,8 @@ static const struct file_operations fops = {
 	.owner		= THIS_MODULE,
 	.read		= usbtmc_read,
 	.write		= usbtmc_write,
+	.read_iter	= usbtmc_read_iter,
+	.write_iter	= usbtmc_write_iter,
 	.open		= usbtmc_open,
 	.release	= usbtmc_release,
 	.unlocked_ioctl	= usbtmc_ioctl,
@@ -1553,6 +4583,7 @@ static const struct file_operations fops = {
 #endif
 	.fasync         = usbtmc_fasync,
 	.poll           = usbtmc_poll,
+	.mmap		= usbtmc_mmap,
 	.llseek		= default_llseek,
 };
 
@@ -1566,6 +4597,7 @@ static void usbtmc_interrupt(struct urb *urb)
 {
 	struct usbtmc_device_data *data = urb->context;
 	struct device *dev = &data->intf->dev;
+	u8 *buffer = urb->transfer_buffer;
 	int status = urb->status;
 	int rv;
 
@@ -1575,41 +4607,62 @@ static void usbtmc_interrupt(struct urb *urb)
 	switch (status) {
 	case 0: /* SUCCESS */
 		/* check for valid STB notification */
-		if (data->iin_buffer[0] > 0x81) {
-			data->bNotify1 = data->iin_buffer[0];
-			data->bNotify2 = data->iin_buffer[1];
+		if (buffer[0] > 0x81) {
+			/*
+			 * The interrupt URBs complete in order; a response to
+			 * an earlier READ_STATUS_BYTE that timed out is
+			 * recognized by its bTag and dropped.
+			 */
+			if ((buffer[0] & 0x7f) != READ_ONCE(data->iin_bTag)) {
+				dev_dbg(dev, "stale stb notification bTag %x\n",
+					buffer[0] & 0x7f);
+				goto exit;
+			}
+			data->bNotify1 = buffer[0];
+			data->bNotify2 = buffer[1];
 			atomic_set(&data->iin_data_valid, 1);
 			wake_up_interruptible(&data->waitq);
 			goto exit;
 		}
 		/* check for SRQ notification */
-		if (data->iin_buffer[0] == 0x81) {
-			struct list_head *elem;
-
+		if (buffer[0] == 0x81) {
+			struct usbtmc_srq_event event = {
+				.timestamp = ktime_get_ns(),
+				.stb = buffer[1],
+			};
+			struct usbtmc_file_data *file_data;
+
+			WRITE_ONCE(data->ts.srq, event.timestamp);
+			WRITE_ONCE(data->ts.srq_stb, event.stb);
 			if (data->fasync)
 				kill_fasync(&data->fasync,
 					SIGIO, POLL_PRI);
 
-			spin_lock(&data->dev_lock);
-			list_for_each(elem, &data->file_list) {
-				struct usbtmc_file_data *file_data;
-
-				file_data = list_entry(elem,
-						struct usbtmc_file_data,
-						file_elem);
-				file_data->srq_byte = data->iin_buffer[1];
-				atomic_set(&file_data->srq_asserted, 1);
+			rcu_read_lock();
+			list_for_each_entry_rcu(file_data, &data->file_list,
+						file_elem) {
+				spin_lock(&file_data->srq_lock);
+				/* Keep the latest status, drop the oldest */
+				if (kfifo_is_full(&file_data->srq_queue)) {
+					kfifo_skip(&file_data->srq_queue);
+					file_data->srq_overflow++;
+				}
+				kfifo_put(&file_data->srq_queue, event);
+				if (file_data->srq_eventfd)
+					eventfd_signal(file_data->srq_eventfd,
+						       1);
+				wake_up_interruptible(&file_data->srq_waitq);
+				spin_unlock(&file_data->srq_lock);
 			}
-			spin_unlock(&data->dev_lock);
+			rcu_read_unlock();
 
 			dev_dbg(dev, "srq received bTag %x stb %x\n",
-				(unsigned int)data->iin_buffer[0],
-				(unsigned int)data->iin_buffer[1]);
+				(unsigned int)buffer[0],
+				(unsigned int)buffer[1]);
 			wake_up_interruptible_all(&data->waitq);
 			goto exit;
 		}
-		dev_warn(dev, "invalid notification: %x\n",
-			data->iin_buffer[0]);
+		dev_warn(dev, "invalid notification: %x\n", buffer[0]);
 		break;
 	case -EOVERFLOW:
 		dev_err(dev, "overflow with length %d, actual length is %d\n",
@@ -1635,12 +4688,17 @@ exit:
 
 static void usbtmc_free_int(struct usbtmc_device_data *data)
 {
-	if (!data->iin_ep_present || !data->iin_urb)
+	unsigned int i;
+
+	if (!data->iin_ep_present || !data->iin_urb[0])
 		return;
-	usb_kill_urb(data->iin_urb);
-	kfree(data->iin_buffer);
-	usb_free_urb(data->iin_urb);
-	data->iin_urb = NULL;
+	for (i = 0; i < data->iin_pool_size && data->iin_urb[i]; i++)
+		usb_kill_urb(data->iin_urb[i]);
+	for (i = 0; i < data->iin_pool_size && data->iin_urb[i]; i++) {
+		kfree(data->iin_urb[i]->transfer_buffer);
+		usb_free_urb(data->iin_urb[i]);
+		data->iin_urb[i] = NULL;
+	}
 	kref_put(&data->kref, usbtmc_delete);
 }
 
@@ -1650,6 +4708,8 @@ static int usbtmc_probe(struct usb_interface *intf,
 	struct usbtmc_device_data *data;
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint;
+	struct urb *urb;
+	u8 *buffer;
 	int n;
 	int retcode;
 
@@ -1674,10 +4734,16 @@ static int usbtmc_probe(struct usb_interface *intf,
 	usb_set_intfdata(intf, data);
 	kref_init(&data->kref);
 	mutex_init(&data->io_mutex);
+	mutex_init(&data->in_mutex);
+	mutex_init(&data->out_mutex);
 	init_waitqueue_head(&data->waitq);
 	atomic_set(&data->iin_data_valid, 0);
 	INIT_LIST_HEAD(&data->file_list);
 	spin_lock_init(&data->dev_lock);
+	init_usb_anchor(&data->in_anchor);
+	init_usb_anchor(&data->out_anchor);
+	init_usb_anchor(&data->aio_anchor);
+	init_usb_anchor(&data->ctrl_anchor);
 
 	data->zombie = 0;
 
@@ -1700,6 +4766,7 @@ static int usbtmc_probe(struct usb_interface *intf,
 
 		if (usb_endpoint_is_bulk_in(endpoint)) {
 			data->bulk_in = endpoint->bEndpointAddress;
+			data->bulk_in_maxp = usb_endpoint_maxp(endpoint);
 			dev_dbg(&intf->dev, "Found bulk in endpoint at %u\n",
 				data->bulk_in);
 			break;
@@ -1717,6 +4784,42 @@ static int usbtmc_probe(struct usb_interface *intf,
 			break;
 		}
 	}
+	if (!data->bulk_in || !data->bulk_out) {
+		dev_err(&intf->dev, "bulk endpoints not found\n");
+		kref_put(&data->kref, usbtmc_delete);
+		return -ENODEV;
+	}
+
+	/* The buffer sizes are multiples of it */
+	if (!data->bulk_in_maxp) {
+		dev_err(&intf->dev, "bulk in endpoint has wMaxPacketSize 0\n");
+		kref_put(&data->kref, usbtmc_delete);
+		return -EINVAL;
+	}
+
+	/* Bulk in URBs must be a multiple of wMaxPacketSize */
+	data->bufsize = max_t(size_t,
+			      rounddown(io_buffer_size, data->bulk_in_maxp),
+			      data->bulk_in_maxp);
+	data->in_pool_size = clamp_t(unsigned int, in_urbs,
+				     1, USBTMC_MAX_URBS);
+	data->out_pool_size = clamp_t(unsigned int, out_urbs,
+				      1, USBTMC_MAX_URBS);
+	data->iin_pool_size = clamp_t(unsigned int, iin_urbs,
+				      1, USBTMC_MAX_URBS);
+	data->in_pool = usbtmc_alloc_pool(data, data->in_pool_size,
+					  data->bufsize);
+	data->out_pool = usbtmc_alloc_pool(data, data->out_pool_size,
+					   data->bufsize);
+	/* A TRIGGER message is only a header */
+	data->trig_urb = usbtmc_alloc_pool(data, 1, USBTMC_HEADER_SIZE);
+	data->zc_out_buf = kzalloc(USBTMC_HEADER_SIZE + 4, GFP_KERNEL);
+	if (!data->in_pool || !data->out_pool || !data->trig_urb ||
+	    !data->zc_out_buf) {
+		kref_put(&data->kref, usbtmc_delete);
+		return -ENOMEM;
+	}
+
 	/* Find int endpoint */
 	for (n = 0; n < iface_desc->desc.bNumEndpoints; n++) {
 		endpoint = &iface_desc->endpoint[n].desc;
@@ -1739,33 +4842,37 @@ static int usbtmc_probe(struct usb_interface *intf,
 		retcode = sysfs_create_group(&intf->dev.kobj,
 					     &capability_attr_grp);
 
-	if (data->iin_ep_present) {
+	for (n = 0; data->iin_ep_present && n < data->iin_pool_size; n++) {
 		/* allocate int urb */
-		data->iin_urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!data->iin_urb) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb) {
 			retcode = -ENOMEM;
 			goto error_register;
 		}
 
 		/* Protect interrupt in endpoint data until iin_urb is freed */
-		kref_get(&data->kref);
+		if (n == 0)
+			kref_get(&data->kref);
+		data->iin_urb[n] = urb;
 
 		/* allocate buffer for interrupt in */
-		data->iin_buffer = kmalloc(data->iin_wMaxPacketSize,
-					GFP_KERNEL);
-		if (!data->iin_buffer) {
+		buffer = kmalloc(data->iin_wMaxPacketSize, GFP_KERNEL);
+		if (!buffer) {
 			retcode = -ENOMEM;
 			goto error_register;
 		}
 
 		/* fill interrupt urb */
-		usb_fill_int_urb(data->iin_urb, data->usb_dev,
+		usb_fill_int_urb(urb, data->usb_dev,
 				usb_rcvintpipe(data->usb_dev, data->iin_ep),
-				data->iin_buffer, data->iin_wMaxPacketSize,
+				buffer, data->iin_wMaxPacketSize,
 				usbtmc_interrupt,
 				data, data->iin_interval);
+	}
 
-		retcode = usb_submit_urb(data->iin_urb, GFP_KERNEL);
+	/* Queue all interrupt URBs so that no notification is missed */
+	for (n = 0; data->iin_ep_present && n < data->iin_pool_size; n++) {
+		retcode = usb_submit_urb(data->iin_urb[n], GFP_KERNEL);
 		if (retcode) {
 			dev_err(&intf->dev, "Failed to submit iin_urb\n");
 			goto error_register;
@@ -1796,6 +4903,7 @@ error_register:
 static void usbtmc_disconnect(struct usb_interface *intf)
 {
 	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+	struct usbtmc_file_data *file_data;
 
 	dev_dbg(&intf->dev, "%s - called\n", __func__);
 
@@ -1803,9 +4911,19 @@ static void usbtmc_disconnect(struct usb_interface *intf)
 	sysfs_remove_group(&intf->dev.kobj, &capability_attr_grp);
 	sysfs_remove_group(&intf->dev.kobj, &data_attr_grp);
 	mutex_lock(&data->io_mutex);
-	data->zombie = 1;
+	mutex_lock(&data->in_mutex);
+	mutex_lock(&data->out_mutex);
+	WRITE_ONCE(data->zombie, 1);
 	wake_up_interruptible_all(&data->waitq);
+	rcu_read_lock();
+	list_for_each_entry_rcu(file_data, &data->file_list, file_elem)
+		wake_up_interruptible_all(&file_data->srq_waitq);
+	rcu_read_unlock();
+	mutex_unlock(&data->out_mutex);
+	mutex_unlock(&data->in_mutex);
 	mutex_unlock(&data->io_mutex);
+	usb_kill_anchored_urbs(&data->aio_anchor);
+	usb_kill_anchored_urbs(&data->ctrl_anchor);
 	usbtmc_free_int(data);
 	kref_put(&data->kref, usbtmc_delete);
 
@@ -1814,7 +4932,13 @@ static void usbtmc_disconnect(struct usb_interface *intf)
 
 static int usbtmc_suspend(struct usb_interface *intf, pm_message_t message)
 {
-	/* this driver does not have pending URBs */
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+
+	/* cancel reads and writes in progress */
+	usb_kill_anchored_urbs(&data->in_anchor);
+	usb_kill_anchored_urbs(&data->out_anchor);
+	usb_kill_anchored_urbs(&data->aio_anchor);
+	usb_kill_anchored_urbs(&data->ctrl_anchor);
 	return 0;
 }
 